@@ -0,0 +1,582 @@
+/*
+ * Connection scaling benchmark
+ *
+ * Forks an echo server with a co-routine per connection, then raises
+ * the number of connections to it in steps. At each step every
+ * connection sends messages on a fixed schedule so that the offered load
+ * is the same whatever the server's latency, and each latency is
+ * measured from when its message was due to be sent rather than when it
+ * was sent, so stalls are not hidden by coordinated omission. Reports
+ * the connect rate, latency, and the server's resident memory, mapped
+ * regions and pooled stacks at each step.
+ *
+ * Usage: c10k [connections] [requests per second] [seconds per step]
+ *
+ * Connections are spread over several loopback addresses so that the
+ * client does not run out of ports, but each process must be allowed to
+ * open a descriptor per connection (see ulimit -n) and the server maps
+ * two regions per connection for its stack and guard page (see
+ * vm.max_map_count).
+ *
+ * Author:  Curtis Millar
+ * Date:    11 October 2019
+ * Licence: MIT
+ */
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <routines.h>
+
+#include "histogram.h"
+
+#define DEFAULT_CONNECTIONS 100000
+#define DEFAULT_RATE        50000
+#define DEFAULT_SECONDS     2
+
+#define LISTEN_BACKLOG 4096
+
+/* Loopback addresses connections are spread over */
+#define ADDRESSES 16
+
+/* Bytes in each message echoed */
+#define MESSAGE_SIZE 64
+
+/* Bytes of a message the server reads at once */
+#define BUFFER_SIZE 4096
+
+/* Descriptors kept back from connections */
+#define RESERVED_FDS 64
+
+/* Time given to every connection to start before the schedule begins */
+#define SETTLE_TIME 100000000
+
+#define TRY(e) { \
+	if ((e) < 0) { \
+		perror(#e); \
+		exit(EXIT_FAILURE); \
+	} \
+}
+
+/* Server resource usage, sent to the client over the control socket */
+typedef struct {
+	/* Connections open */
+	size_t connections;
+	/* Resident memory in bytes */
+	size_t rss;
+	/* Mapped memory regions */
+	size_t vmas;
+	/* Stacks kept for reuse */
+	size_t unused_stacks;
+} server_stats_t;
+
+/* Echo server state */
+static struct {
+	routines_buffers_t *buffers;
+	size_t connections;
+} server;
+
+/* Load offered by the client during a step */
+static struct {
+	uint16_t port;
+	/* Connections open */
+	size_t connections;
+	/* Time between messages on each connection */
+	uint64_t interval;
+	/* Bounds of the schedule */
+	uint64_t start;
+	uint64_t end;
+	/* Connections report here when they are ready for a step */
+	routines_queue_t *ready;
+	/* Connections wait here for a step to start */
+	routines_queue_t *go;
+} load;
+
+/* Results of the current step */
+static struct {
+	histogram_t latency;
+	uint64_t requests;
+} results;
+
+/* Run the echo server until the control socket is closed */
+static void run_server(int listen_fd, int control_fd);
+
+/* Accept connections and give each its own worker */
+static void accept_connections(void *arg);
+
+/* Echo everything received on a connection */
+static void echo_connection(void *arg);
+
+/* Answer requests for resource usage from the client */
+static void report_stats(void *arg);
+
+/* Run the steps of the benchmark against the server */
+static void run_client(void *arg);
+
+/* Connect and send scheduled messages in every step */
+static void run_connection(void *arg);
+
+/* Send a message and wait for it to be echoed back */
+static bool echo(int fd);
+
+/* Ask the server for its resource usage */
+static void server_stats(int control_fd, server_stats_t *stats);
+
+/* Count the lines of a file */
+static size_t count_lines(const char *path);
+
+/* Client arguments */
+typedef struct {
+	size_t connections;
+	uint64_t rate;
+	uint64_t seconds;
+	int control_fd;
+} client_args_t;
+
+int main(int argc, char **argv) {
+	client_args_t args = {
+		.connections = argc > 1 ? atol(argv[1]) : DEFAULT_CONNECTIONS,
+		.rate = argc > 2 ? atol(argv[2]) : DEFAULT_RATE,
+		.seconds = argc > 3 ? atol(argv[3]) : DEFAULT_SECONDS,
+	};
+	if (args.connections == 0 || args.rate == 0 || args.seconds == 0) {
+		fprintf(stderr, "usage: %s [connections] [rate] [seconds]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	/* Each process holds one descriptor per connection */
+	struct rlimit files;
+	TRY(getrlimit(RLIMIT_NOFILE, &files));
+	files.rlim_cur = files.rlim_max;
+	TRY(setrlimit(RLIMIT_NOFILE, &files));
+	if (files.rlim_cur < args.connections + RESERVED_FDS) {
+		args.connections = files.rlim_cur - RESERVED_FDS;
+		fprintf(
+			stderr,
+			"limited to %zu connections by the file descriptor limit\n",
+			args.connections
+		);
+	}
+
+	int listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	TRY(listen_fd);
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = 0,
+		.sin_addr = (struct in_addr) {htonl(INADDR_ANY)},
+	};
+	socklen_t addr_size = sizeof(addr);
+	TRY(bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)));
+	TRY(listen(listen_fd, LISTEN_BACKLOG));
+	TRY(getsockname(listen_fd, (struct sockaddr *)&addr, &addr_size));
+
+	int control[2];
+	TRY(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, control));
+
+	pid_t pid = fork();
+	TRY(pid);
+	if (pid == 0) {
+		close(control[0]);
+		run_server(listen_fd, control[1]);
+		_exit(EXIT_SUCCESS);
+	}
+	close(control[1]);
+	close(listen_fd);
+
+	load.port = addr.sin_port;
+	load.ready = routines_queue_create();
+	load.go = routines_queue_create();
+	assert(load.ready != NULL && load.go != NULL);
+
+	args.control_fd = control[0];
+	routines_coroutine_t *client = routines_spawn(run_client, &args);
+	assert(client != NULL);
+
+	while (routines_poll());
+
+	routines_destroy(client);
+	routines_queue_destroy(load.ready);
+	routines_queue_destroy(load.go);
+
+	/* The server exits once the control socket closes */
+	close(control[0]);
+	waitpid(pid, NULL, 0);
+
+	return EXIT_SUCCESS;
+}
+
+static void run_server(int listen_fd, int control_fd) {
+	server.buffers = routines_buffers_create(BUFFER_SIZE, 0);
+	routines_pool_t *workers = routines_pool_create(
+		echo_connection,
+		0,
+		SIZE_MAX
+	);
+	assert(server.buffers != NULL && workers != NULL);
+
+	void *args[] = {(void *)(intptr_t)listen_fd, workers};
+	routines_coroutine_t *acceptor = routines_spawn(
+		accept_connections,
+		args
+	);
+	routines_coroutine_t *reporter = routines_spawn(
+		report_stats,
+		(void *)(intptr_t)control_fd
+	);
+	assert(acceptor != NULL && reporter != NULL);
+
+	/* Serve until the reporter sees the client exit */
+	while (routines_state(reporter) != ROUTINES_COMPLETED) {
+		routines_poll();
+	}
+
+	routines_destroy(acceptor);
+	routines_destroy(reporter);
+	routines_pool_destroy(workers);
+	routines_buffers_destroy(server.buffers);
+}
+
+static void accept_connections(void *arg) {
+	void **args = arg;
+	int listen_fd = (intptr_t)args[0];
+	routines_pool_t *workers = args[1];
+
+	while (true) {
+		int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK);
+		if (fd < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				routines_wait_fd(listen_fd, EPOLLIN, NULL);
+			} else if (errno != EINTR && errno != ECONNABORTED) {
+				perror("accept4");
+				routines_sleep(10000000);
+			}
+			continue;
+		}
+
+		int nodelay = true;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+		/* Work must not be NULL, which descriptor 0 would be */
+		if (routines_pool_submit(workers, (void *)(intptr_t)(fd + 1)) != 0) {
+			close(fd);
+		}
+	}
+}
+
+static void echo_connection(void *arg) {
+	int fd = (intptr_t)arg - 1;
+	server.connections += 1;
+
+	while (true) {
+		/* Idle connections hold no buffer */
+		void *buffer;
+		ssize_t bytes = routines_read_pooled(fd, server.buffers, &buffer);
+		if (bytes <= 0) {
+			break;
+		}
+
+		ssize_t written = 0;
+		while (written < bytes) {
+			ssize_t sent = send(
+				fd,
+				(char *)buffer + written,
+				bytes - written,
+				MSG_DONTWAIT | MSG_NOSIGNAL
+			);
+			if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				routines_wait_fd(fd, EPOLLOUT, NULL);
+			} else if (sent < 0 && errno != EINTR) {
+				break;
+			} else if (sent > 0) {
+				written += sent;
+			}
+		}
+		routines_buffer_release(server.buffers, buffer);
+
+		if (written < bytes) {
+			break;
+		}
+	}
+
+	close(fd);
+	server.connections -= 1;
+}
+
+static void report_stats(void *arg) {
+	int fd = (intptr_t)arg;
+
+	while (true) {
+		char request;
+		ssize_t bytes = read(fd, &request, 1);
+		if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			routines_wait_fd(fd, EPOLLIN, NULL);
+			continue;
+		} else if (bytes < 0 && errno == EINTR) {
+			continue;
+		} else if (bytes <= 0) {
+			return;
+		}
+
+		size_t pages = 0;
+		FILE *statm = fopen("/proc/self/statm", "r");
+		if (statm != NULL) {
+			if (fscanf(statm, "%*u %zu", &pages) != 1) {
+				pages = 0;
+			}
+			fclose(statm);
+		}
+
+		server_stats_t stats = {
+			.connections = server.connections,
+			.rss = pages * sysconf(_SC_PAGESIZE),
+			.vmas = count_lines("/proc/self/maps"),
+			.unused_stacks = routines_unused_stacks(),
+		};
+
+		/* The reply is far smaller than the socket buffer */
+		if (write(fd, &stats, sizeof(stats)) != sizeof(stats)) {
+			return;
+		}
+	}
+}
+
+static void run_client(void *arg) {
+	client_args_t *args = arg;
+	static const size_t steps[] = {
+		1000, 2000, 5000, 10000, 20000, 50000, 100000, 200000, 500000,
+	};
+
+	server_stats_t idle;
+	server_stats(args->control_fd, &idle);
+
+	printf(
+		"%8s %10s %10s %9s %9s %9s %9s %9s %9s %7s %7s\n",
+		"conns", "connect/s", "req/s", "p50 us", "p99 us", "p99.9 us",
+		"max us", "RSS MiB", "KiB/conn", "VMAs", "stacks"
+	);
+
+	for (size_t s = 0; load.connections < args->connections; s += 1) {
+		size_t target = args->connections;
+		if (s < sizeof(steps) / sizeof(*steps) && steps[s] < target) {
+			target = steps[s];
+		}
+
+		/* Open new connections and wait for each to echo once */
+		uint64_t opening = routines_clock();
+		size_t opened = target - load.connections;
+		for (size_t c = load.connections; c < target; c += 1) {
+			routines_coroutine_t *connection = routines_spawn(
+				run_connection,
+				(void *)(uintptr_t)c
+			);
+			assert(connection != NULL);
+		}
+		for (size_t c = 0; c < opened; c += 1) {
+			routines_wait(load.ready);
+		}
+		double connect_rate = opened / ((routines_clock() - opening) / 1e9);
+		load.connections = target;
+
+		/* Offer the same total rate however many connections there are */
+		histogram_reset(&results.latency);
+		results.requests = 0;
+		load.interval = target * 1000000000 / args->rate;
+		load.start = routines_clock() + SETTLE_TIME;
+		load.end = load.start + args->seconds * 1000000000;
+		for (size_t c = 0; c < target; c += 1) {
+			routines_signal(load.go, NULL);
+		}
+		for (size_t c = 0; c < target; c += 1) {
+			routines_wait(load.ready);
+		}
+
+		server_stats_t stats;
+		server_stats(args->control_fd, &stats);
+		printf(
+			"%8zu %10.0f %10.0f %9.1f %9.1f %9.1f %9.1f %9.1f %9.2f %7zu %7zu\n",
+			stats.connections,
+			connect_rate,
+			results.requests / (double)args->seconds,
+			histogram_percentile(&results.latency, 50) / 1000.0,
+			histogram_percentile(&results.latency, 99) / 1000.0,
+			histogram_percentile(&results.latency, 99.9) / 1000.0,
+			results.latency.max / 1000.0,
+			stats.rss / 1048576.0,
+			((double)stats.rss - idle.rss) / 1024 / stats.connections,
+			stats.vmas,
+			stats.unused_stacks
+		);
+		fflush(stdout);
+	}
+
+	/* Close every connection and see what the server keeps */
+	load.end = 0;
+	for (size_t c = 0; c < load.connections; c += 1) {
+		routines_signal(load.go, NULL);
+	}
+	for (size_t c = 0; c < load.connections; c += 1) {
+		routines_wait(load.ready);
+	}
+
+	server_stats_t closed;
+	do {
+		routines_sleep(SETTLE_TIME);
+		server_stats(args->control_fd, &closed);
+	} while (closed.connections > 0);
+	printf(
+		"%8s %10s %10s %9s %9s %9s %9s %9.1f %9s %7zu %7zu\n",
+		"closed", "", "", "", "", "", "",
+		closed.rss / 1048576.0,
+		"",
+		closed.vmas,
+		closed.unused_stacks
+	);
+}
+
+static void run_connection(void *arg) {
+	size_t id = (uintptr_t)arg;
+
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (fd < 0) {
+		goto failed;
+	}
+	int nodelay = true;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+	/* Spread connections over 127.0.0.1 to 127.0.0.16 */
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = load.port,
+		.sin_addr = (struct in_addr) {
+			htonl(INADDR_LOOPBACK + id % ADDRESSES),
+		},
+	};
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		if (errno != EINPROGRESS) {
+			goto failed;
+		}
+
+		int error = 0;
+		socklen_t size = sizeof(error);
+		routines_wait_fd(fd, EPOLLOUT, NULL);
+		getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &size);
+		if (error != 0) {
+			goto failed;
+		}
+	}
+
+	/* The connection is only counted once the server has answered */
+	if (!echo(fd)) {
+		goto failed;
+	}
+
+	while (true) {
+		routines_signal(load.ready, NULL);
+		routines_wait(load.go);
+		if (load.end == 0) {
+			break;
+		}
+
+		/* Stagger connections evenly over the interval */
+		uint64_t due = load.start + load.interval * id / load.connections;
+		for (; due < load.end; due += load.interval) {
+			routines_sleep_until(due);
+			if (!echo(fd)) {
+				goto failed;
+			}
+
+			/* Late sends are charged from when they were due */
+			histogram_record(&results.latency, routines_clock() - due);
+			results.requests += 1;
+		}
+	}
+
+	close(fd);
+	routines_signal(load.ready, NULL);
+	return;
+
+failed:
+	/* Results would be skewed by a missing connection */
+	perror("connection");
+	exit(EXIT_FAILURE);
+}
+
+static bool echo(int fd) {
+	static const char message[MESSAGE_SIZE] = "ping";
+	char reply[MESSAGE_SIZE];
+
+	ssize_t sent = send(fd, message, sizeof(message), MSG_NOSIGNAL);
+	if (sent != sizeof(message)) {
+		return false;
+	}
+
+	size_t received = 0;
+	while (received < sizeof(reply)) {
+		ssize_t bytes = recv(
+			fd,
+			reply + received,
+			sizeof(reply) - received,
+			MSG_DONTWAIT
+		);
+		if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			routines_wait_fd(fd, EPOLLIN, NULL);
+		} else if (bytes == 0 || (bytes < 0 && errno != EINTR)) {
+			return false;
+		} else if (bytes > 0) {
+			received += bytes;
+		}
+	}
+
+	return true;
+}
+
+static void server_stats(int control_fd, server_stats_t *stats) {
+	char request = 's';
+	TRY(write(control_fd, &request, 1));
+
+	size_t received = 0;
+	while (received < sizeof(*stats)) {
+		ssize_t bytes = read(
+			control_fd,
+			(char *)stats + received,
+			sizeof(*stats) - received
+		);
+		if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			routines_wait_fd(control_fd, EPOLLIN, NULL);
+		} else if (bytes == 0) {
+			fprintf(stderr, "server exited\n");
+			exit(EXIT_FAILURE);
+		} else if (bytes > 0) {
+			received += bytes;
+		} else {
+			TRY(bytes);
+		}
+	}
+}
+
+static size_t count_lines(const char *path) {
+	FILE *file = fopen(path, "r");
+	if (file == NULL) {
+		return 0;
+	}
+
+	size_t lines = 0;
+	for (int c = fgetc(file); c != EOF; c = fgetc(file)) {
+		lines += c == '\n';
+	}
+	fclose(file);
+	return lines;
+}
@@ -0,0 +1,524 @@
+/*
+ * Comparison of co-routines with other ways of switching tasks
+ *
+ * Runs the same workloads on routines, on ucontext with swapcontext, on
+ * pthreads with condition variables and, when built with it, on
+ * Boost.Context fibers:
+ *
+ *   ping-pong - two tasks switch back and forth,
+ *   rpc       - a client sends a request to a server and waits for the
+ *               reply, with routines_call for co-routines, and
+ *   fan-out   - many tasks are started, each does a trivial step of work
+ *               and all of them are joined.
+ *
+ * Prints a table of the time per operation, where an operation is one
+ * round trip or one task.
+ *
+ * Usage: compare [round trips] [tasks]
+ *
+ * Author:  Curtis Millar
+ * Date:    11 October 2019
+ * Licence: MIT
+ */
+
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <utility>
+#include <vector>
+#include <pthread.h>
+#include <ucontext.h>
+
+#ifdef HAVE_BOOST_CONTEXT
+#include <boost/context/fiber.hpp>
+#include <boost/context/fixedsize_stack.hpp>
+#endif
+
+#include <routines.h>
+
+#define DEFAULT_ROUND_TRIPS 200000
+#define DEFAULT_TASKS       10000
+
+/* Stack given to each task that needs one, as for co-routines */
+#define TASK_STACK_SIZE (4096 * 8)
+
+/* Threads need more than the minimum to start */
+#define THREAD_STACK_SIZE (4096 * 16)
+
+/* A workload run on one kind of task */
+typedef uint64_t (*workload_t)(size_t count);
+
+/* Row of the results table */
+typedef struct {
+	const char *workload;
+	const char *runtime;
+	workload_t run;
+	bool round_trips;
+} benchmark_t;
+
+/* Nanoseconds since an arbitrary point */
+static uint64_t now() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()
+	).count();
+}
+
+/* Work done by each task of a fan-out */
+static volatile size_t fan_out_total;
+
+/*
+ * routines
+ */
+
+/* Run a benchmark in a co-routine, as joins must be made from one */
+static uint64_t routines_run(routines_function_t body, size_t count) {
+	uint64_t elapsed = 0;
+	void *args[] = {&count, &elapsed};
+
+	routines_coroutine_t *driver = routines_spawn_function(body, args);
+	assert(driver != nullptr);
+	while (routines_state(driver) != ROUTINES_COMPLETED) {
+		routines_yield();
+	}
+	routines_destroy(driver);
+
+	return elapsed;
+}
+
+static void routines_ping_pong_task(void *arg) {
+	size_t count = *static_cast<size_t *>(arg);
+	for (size_t r = 0; r < count; r += 1) {
+		routines_yield();
+	}
+}
+
+static void *routines_ping_pong_body(void *arg) {
+	void **args = static_cast<void **>(arg);
+	size_t count = *static_cast<size_t *>(args[0]);
+
+	uint64_t start = now();
+	routines_coroutine_t *ping, *pong;
+	ping = routines_spawn(routines_ping_pong_task, &count);
+	pong = routines_spawn(routines_ping_pong_task, &count);
+	assert(ping != nullptr && pong != nullptr);
+	routines_join(ping);
+	routines_join(pong);
+	*static_cast<uint64_t *>(args[1]) = now() - start;
+
+	routines_destroy(ping);
+	routines_destroy(pong);
+	return nullptr;
+}
+
+static uint64_t routines_ping_pong(size_t count) {
+	return routines_run(routines_ping_pong_body, count);
+}
+
+static void routines_rpc_server(void *arg) {
+	routines_queue_t *requests = static_cast<routines_queue_t *>(arg);
+	while (true) {
+		routines_queue_t *reply;
+		void *request = routines_recv(requests, &reply);
+		routines_signal(reply, request);
+	}
+}
+
+static void *routines_rpc_body(void *arg) {
+	void **args = static_cast<void **>(arg);
+	size_t count = *static_cast<size_t *>(args[0]);
+
+	routines_queue_t *requests = routines_queue_create();
+	routines_queue_t *replies = routines_queue_create();
+	routines_coroutine_t *server = routines_spawn(
+		routines_rpc_server,
+		requests
+	);
+	assert(requests != nullptr && replies != nullptr && server != nullptr);
+
+	uint64_t start = now();
+	for (size_t c = 1; c <= count; c += 1) {
+		void *request = reinterpret_cast<void *>(c);
+		void *reply = routines_call(requests, request, replies);
+		assert(reply == request);
+		(void)reply;
+	}
+	*static_cast<uint64_t *>(args[1]) = now() - start;
+
+	routines_destroy(server);
+	routines_queue_destroy(requests);
+	routines_queue_destroy(replies);
+	return nullptr;
+}
+
+static uint64_t routines_rpc(size_t count) {
+	return routines_run(routines_rpc_body, count);
+}
+
+static void routines_fan_out_task(void *) {
+	fan_out_total = fan_out_total + 1;
+}
+
+static void *routines_fan_out_body(void *arg) {
+	void **args = static_cast<void **>(arg);
+	size_t count = *static_cast<size_t *>(args[0]);
+	std::vector<routines_coroutine_t *> tasks(count);
+
+	uint64_t start = now();
+	for (size_t t = 0; t < count; t += 1) {
+		tasks[t] = routines_spawn(routines_fan_out_task, nullptr);
+		assert(tasks[t] != nullptr);
+	}
+	for (size_t t = 0; t < count; t += 1) {
+		routines_join(tasks[t]);
+		routines_destroy(tasks[t]);
+	}
+	*static_cast<uint64_t *>(args[1]) = now() - start;
+
+	return nullptr;
+}
+
+static uint64_t routines_fan_out(size_t count) {
+	return routines_run(routines_fan_out_body, count);
+}
+
+/*
+ * ucontext
+ */
+
+/* Contexts of a pair of tasks and the message passed between them */
+static struct {
+	ucontext_t main;
+	ucontext_t task;
+	size_t count;
+	uintptr_t message;
+} contexts;
+
+/* Allocate a context to run a function on its own stack */
+static void context_make(
+	ucontext_t *context,
+	void (*function)(),
+	ucontext_t *link
+) {
+	getcontext(context);
+	context->uc_stack.ss_sp = std::malloc(TASK_STACK_SIZE);
+	context->uc_stack.ss_size = TASK_STACK_SIZE;
+	context->uc_link = link;
+	assert(context->uc_stack.ss_sp != nullptr);
+	makecontext(context, function, 0);
+}
+
+static void ucontext_ping_pong_task() {
+	for (size_t r = 0; r < contexts.count; r += 1) {
+		swapcontext(&contexts.task, &contexts.main);
+	}
+}
+
+static uint64_t ucontext_ping_pong(size_t count) {
+	contexts.count = count;
+	context_make(&contexts.task, ucontext_ping_pong_task, &contexts.main);
+
+	uint64_t start = now();
+	for (size_t r = 0; r <= count; r += 1) {
+		swapcontext(&contexts.main, &contexts.task);
+	}
+	uint64_t elapsed = now() - start;
+
+	std::free(contexts.task.uc_stack.ss_sp);
+	return elapsed;
+}
+
+static void ucontext_rpc_server() {
+	for (size_t c = 0; c < contexts.count; c += 1) {
+		/* The reply is left in place of the request */
+		swapcontext(&contexts.task, &contexts.main);
+	}
+}
+
+static uint64_t ucontext_rpc(size_t count) {
+	contexts.count = count;
+	context_make(&contexts.task, ucontext_rpc_server, &contexts.main);
+
+	/* Start the server so that it waits for the first request */
+	swapcontext(&contexts.main, &contexts.task);
+
+	uint64_t start = now();
+	for (size_t c = 1; c <= count; c += 1) {
+		contexts.message = c;
+		swapcontext(&contexts.main, &contexts.task);
+		assert(contexts.message == c);
+	}
+	uint64_t elapsed = now() - start;
+
+	std::free(contexts.task.uc_stack.ss_sp);
+	return elapsed;
+}
+
+static void ucontext_fan_out_task() {
+	fan_out_total = fan_out_total + 1;
+}
+
+static uint64_t ucontext_fan_out(size_t count) {
+	std::vector<ucontext_t> tasks(count);
+
+	uint64_t start = now();
+	for (size_t t = 0; t < count; t += 1) {
+		context_make(&tasks[t], ucontext_fan_out_task, &contexts.main);
+	}
+	for (size_t t = 0; t < count; t += 1) {
+		swapcontext(&contexts.main, &tasks[t]);
+		std::free(tasks[t].uc_stack.ss_sp);
+	}
+	return now() - start;
+}
+
+/*
+ * pthreads
+ */
+
+/* A pair of threads taking turns */
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	size_t count;
+	/* Thread whose turn it is */
+	int turn;
+	uintptr_t message;
+} threads = {
+	PTHREAD_MUTEX_INITIALIZER,
+	PTHREAD_COND_INITIALIZER,
+	0,
+	0,
+	0,
+};
+
+/* Wait for a turn then hand it to the other thread */
+static void thread_take_turn(int self) {
+	pthread_mutex_lock(&threads.lock);
+	while (threads.turn != self) {
+		pthread_cond_wait(&threads.changed, &threads.lock);
+	}
+	threads.turn = !self;
+	pthread_cond_signal(&threads.changed);
+	pthread_mutex_unlock(&threads.lock);
+}
+
+/* Start a thread with a small stack */
+static pthread_t thread_start(void *(*function)(void *), void *arg) {
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, THREAD_STACK_SIZE);
+
+	pthread_t thread;
+	int error = pthread_create(&thread, &attr, function, arg);
+	assert(error == 0);
+	(void)error;
+
+	pthread_attr_destroy(&attr);
+	return thread;
+}
+
+static void *pthread_ping_pong_task(void *) {
+	for (size_t r = 0; r < threads.count; r += 1) {
+		thread_take_turn(1);
+	}
+	return nullptr;
+}
+
+static uint64_t pthread_ping_pong(size_t count) {
+	threads.count = count;
+	threads.turn = 0;
+
+	uint64_t start = now();
+	pthread_t pong = thread_start(pthread_ping_pong_task, nullptr);
+	for (size_t r = 0; r < count; r += 1) {
+		thread_take_turn(0);
+	}
+	pthread_join(pong, nullptr);
+	return now() - start;
+}
+
+static void *pthread_rpc_server(void *) {
+	for (size_t c = 0; c < threads.count; c += 1) {
+		/* The reply is left in place of the request */
+		thread_take_turn(1);
+	}
+	return nullptr;
+}
+
+static uint64_t pthread_rpc(size_t count) {
+	threads.count = count;
+	threads.turn = 0;
+	pthread_t server = thread_start(pthread_rpc_server, nullptr);
+
+	uint64_t start = now();
+	for (size_t c = 1; c <= count; c += 1) {
+		pthread_mutex_lock(&threads.lock);
+		threads.message = c;
+		threads.turn = 1;
+		pthread_cond_signal(&threads.changed);
+		while (threads.turn != 0) {
+			pthread_cond_wait(&threads.changed, &threads.lock);
+		}
+		assert(threads.message == c);
+		pthread_mutex_unlock(&threads.lock);
+	}
+	uint64_t elapsed = now() - start;
+
+	pthread_join(server, nullptr);
+	return elapsed;
+}
+
+static void *pthread_fan_out_task(void *) {
+	pthread_mutex_lock(&threads.lock);
+	fan_out_total = fan_out_total + 1;
+	pthread_mutex_unlock(&threads.lock);
+	return nullptr;
+}
+
+static uint64_t pthread_fan_out(size_t count) {
+	std::vector<pthread_t> tasks(count);
+
+	uint64_t start = now();
+	for (size_t t = 0; t < count; t += 1) {
+		tasks[t] = thread_start(pthread_fan_out_task, nullptr);
+	}
+	for (size_t t = 0; t < count; t += 1) {
+		pthread_join(tasks[t], nullptr);
+	}
+	return now() - start;
+}
+
+/*
+ * Boost.Context
+ */
+
+#ifdef HAVE_BOOST_CONTEXT
+namespace context = boost::context;
+
+static uint64_t boost_ping_pong(size_t count) {
+	context::fiber pong(
+		std::allocator_arg,
+		context::fixedsize_stack(TASK_STACK_SIZE),
+		[count](context::fiber &&main) {
+			for (size_t r = 0; r < count; r += 1) {
+				main = std::move(main).resume();
+			}
+			return std::move(main);
+		}
+	);
+
+	uint64_t start = now();
+	for (size_t r = 0; r <= count; r += 1) {
+		pong = std::move(pong).resume();
+	}
+	return now() - start;
+}
+
+static uint64_t boost_rpc(size_t count) {
+	uintptr_t message = 0;
+	context::fiber server(
+		std::allocator_arg,
+		context::fixedsize_stack(TASK_STACK_SIZE),
+		[count](context::fiber &&client) {
+			for (size_t c = 0; c <= count; c += 1) {
+				/* The reply is left in place of the request */
+				client = std::move(client).resume();
+			}
+			return std::move(client);
+		}
+	);
+
+	/* Start the server so that it waits for the first request */
+	server = std::move(server).resume();
+
+	uint64_t start = now();
+	for (size_t c = 1; c <= count; c += 1) {
+		message = c;
+		server = std::move(server).resume();
+		assert(message == c);
+	}
+	uint64_t elapsed = now() - start;
+
+	server = std::move(server).resume();
+	return elapsed;
+}
+
+static uint64_t boost_fan_out(size_t count) {
+	std::vector<context::fiber> tasks;
+	tasks.reserve(count);
+
+	uint64_t start = now();
+	for (size_t t = 0; t < count; t += 1) {
+		tasks.emplace_back(
+			std::allocator_arg,
+			context::fixedsize_stack(TASK_STACK_SIZE),
+			[](context::fiber &&main) {
+				fan_out_total = fan_out_total + 1;
+				return std::move(main);
+			}
+		);
+	}
+	for (size_t t = 0; t < count; t += 1) {
+		tasks[t] = std::move(tasks[t]).resume();
+	}
+	tasks.clear();
+	return now() - start;
+}
+#endif
+
+static const benchmark_t benchmarks[] = {
+	{"ping-pong", "routines", routines_ping_pong, true},
+	{"ping-pong", "ucontext", ucontext_ping_pong, true},
+	{"ping-pong", "pthreads", pthread_ping_pong, true},
+#ifdef HAVE_BOOST_CONTEXT
+	{"ping-pong", "boost", boost_ping_pong, true},
+#endif
+	{"rpc", "routines", routines_rpc, true},
+	{"rpc", "ucontext", ucontext_rpc, true},
+	{"rpc", "pthreads", pthread_rpc, true},
+#ifdef HAVE_BOOST_CONTEXT
+	{"rpc", "boost", boost_rpc, true},
+#endif
+	{"fan-out", "routines", routines_fan_out, false},
+	{"fan-out", "ucontext", ucontext_fan_out, false},
+	{"fan-out", "pthreads", pthread_fan_out, false},
+#ifdef HAVE_BOOST_CONTEXT
+	{"fan-out", "boost", boost_fan_out, false},
+#endif
+};
+
+int main(int argc, char **argv) {
+	size_t round_trips = argc > 1 ? std::atol(argv[1]) : DEFAULT_ROUND_TRIPS;
+	size_t tasks = argc > 2 ? std::atol(argv[2]) : DEFAULT_TASKS;
+	if (round_trips == 0 || tasks == 0) {
+		std::fprintf(stderr, "usage: %s [round trips] [tasks]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	std::printf(
+		"%-10s %-10s %10s %12s %14s\n",
+		"workload",
+		"runtime",
+		"ops",
+		"ns/op",
+		"ops/s"
+	);
+	for (const benchmark_t &benchmark : benchmarks) {
+		size_t count = benchmark.round_trips ? round_trips : tasks;
+		uint64_t elapsed = benchmark.run(count);
+		std::printf(
+			"%-10s %-10s %10zu %12.1f %14.0f\n",
+			benchmark.workload,
+			benchmark.runtime,
+			count,
+			(double)elapsed / count,
+			count / (elapsed / 1e9)
+		);
+		std::fflush(stdout);
+	}
+
+	return EXIT_SUCCESS;
+}
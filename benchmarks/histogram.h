@@ -0,0 +1,101 @@
+/*
+ * Latency histograms for the benchmarks
+ *
+ * Values are counted in buckets whose width grows with their magnitude,
+ * as in HDR Histogram, so that any recorded value is reported within 1%
+ * while the histogram stays a fixed size.
+ *
+ * Author:  Curtis Millar
+ * Date:    11 October 2019
+ * Licence: MIT
+ */
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Bits of precision kept for each value */
+#define HISTOGRAM_BITS 7
+
+#define HISTOGRAM_SUBS (1 << HISTOGRAM_BITS)
+
+typedef struct {
+	/* Count of values in each bucket, by magnitude then sub-bucket */
+	uint64_t counts[64][HISTOGRAM_SUBS];
+	/* Number of values recorded */
+	uint64_t total;
+	/* Largest value recorded */
+	uint64_t max;
+} histogram_t;
+
+/* Empty a histogram */
+static inline void histogram_reset(histogram_t *histogram) {
+	memset(histogram, 0, sizeof(*histogram));
+}
+
+/* Count a value */
+static inline void histogram_record(histogram_t *histogram, uint64_t value) {
+	unsigned magnitude = 0;
+	if (value >= HISTOGRAM_SUBS) {
+		magnitude = 64 - __builtin_clzll(value) - HISTOGRAM_BITS;
+	}
+
+	histogram->counts[magnitude][value >> magnitude] += 1;
+	histogram->total += 1;
+	if (value > histogram->max) {
+		histogram->max = value;
+	}
+}
+
+/*
+ * Get the value at a percentile
+ *
+ * Reports the highest value that falls in the same bucket.
+ */
+static inline uint64_t histogram_percentile(
+	const histogram_t *histogram,
+	double percentile
+) {
+	uint64_t rank = histogram->total * percentile / 100.0;
+	if (rank >= histogram->total) {
+		return histogram->max;
+	}
+
+	uint64_t seen = 0;
+	for (unsigned m = 0; m < 64; m += 1) {
+		for (unsigned s = 0; s < HISTOGRAM_SUBS; s += 1) {
+			seen += histogram->counts[m][s];
+			if (seen > rank) {
+				uint64_t highest = (((uint64_t)s + 1) << m) - 1;
+				return highest < histogram->max ? highest : histogram->max;
+			}
+		}
+	}
+
+	return histogram->max;
+}
+
+/* Print the usual percentiles of nanosecond values in microseconds */
+static inline void histogram_print(
+	FILE *file,
+	const char *label,
+	const histogram_t *histogram
+) {
+	static const double percentiles[] = {50, 90, 99, 99.9, 99.99};
+
+	fprintf(file, "%-12s", label);
+	for (size_t p = 0; p < sizeof(percentiles) / sizeof(*percentiles); p += 1) {
+		fprintf(
+			file,
+			" p%g %.1fus",
+			percentiles[p],
+			histogram_percentile(histogram, percentiles[p]) / 1000.0
+		);
+	}
+	fprintf(file, " max %.1fus\n", histogram->max / 1000.0);
+}
+
+#endif /* HISTOGRAM_H */
@@ -0,0 +1,239 @@
+/*
+ * HTTP/1.1 load generator for http_server
+ *
+ * Each connection is driven by a co-routine that sends a pipeline of
+ * requests in one write and waits for every response before sending the
+ * next, recording the latency of each request from when its pipeline was
+ * sent. Reports requests per second and latency percentiles.
+ *
+ * Usage: http_load [port] [connections] [seconds] [pipeline]
+ *
+ * Author:  Curtis Millar
+ * Date:    11 October 2019
+ * Licence: MIT
+ */
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <routines.h>
+
+#include "histogram.h"
+
+#define DEFAULT_PORT        8080
+#define DEFAULT_CONNECTIONS 64
+#define DEFAULT_SECONDS     5
+#define DEFAULT_PIPELINE    16
+#define MAX_PIPELINE        64
+
+/* Bytes of responses that can be buffered */
+#define BUFFER_SIZE 8192
+
+static const char request[] =
+	"GET / HTTP/1.1\r\n"
+	"Host: localhost\r\n"
+	"\r\n";
+
+#define REQUEST_SIZE (sizeof(request) - 1)
+
+/* Settings shared by every connection */
+static struct {
+	struct sockaddr_in addr;
+	int pipeline;
+	uint64_t deadline;
+} load;
+
+/* Results of every connection */
+static struct {
+	histogram_t latency;
+	uint64_t requests;
+	uint64_t errors;
+} results;
+
+/* Drive one connection until the deadline */
+static void run_connection(void *arg);
+
+/* Connect a socket, waiting for the connection to be established */
+static int connect_to(const struct sockaddr_in *addr);
+
+/*
+ * Find the length of the response at the start of a buffer
+ *
+ * Returns 0 if the response is incomplete.
+ */
+static size_t response_size(const char *buffer, size_t length);
+
+int main(int argc, char **argv) {
+	int port = argc > 1 ? atoi(argv[1]) : DEFAULT_PORT;
+	int connections = argc > 2 ? atoi(argv[2]) : DEFAULT_CONNECTIONS;
+	int seconds = argc > 3 ? atoi(argv[3]) : DEFAULT_SECONDS;
+	load.pipeline = argc > 4 ? atoi(argv[4]) : DEFAULT_PIPELINE;
+
+	if (load.pipeline < 1 || load.pipeline > MAX_PIPELINE) {
+		fprintf(stderr, "pipeline must be 1 to %d\n", MAX_PIPELINE);
+		return EXIT_FAILURE;
+	}
+
+	load.addr = (struct sockaddr_in) {
+		.sin_family = AF_INET,
+		.sin_port = htons(port),
+		.sin_addr = (struct in_addr) {htonl(INADDR_LOOPBACK)},
+	};
+
+	uint64_t start = routines_clock();
+	load.deadline = start + (uint64_t)seconds * 1000000000;
+
+	for (int c = 0; c < connections; c += 1) {
+		routines_coroutine_t *client = routines_spawn(run_connection, NULL);
+		assert(client != NULL);
+	}
+
+	while (routines_poll());
+
+	double elapsed = (routines_clock() - start) / 1e9;
+	printf(
+		"%d connections, pipeline %d, %.1fs\n",
+		connections,
+		load.pipeline,
+		elapsed
+	);
+	printf(
+		"%-12s %.0f requests/s, %lu requests, %lu errors\n",
+		"throughput",
+		results.requests / elapsed,
+		results.requests,
+		results.errors
+	);
+	histogram_print(stdout, "latency", &results.latency);
+
+	return results.errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static void run_connection(void *arg) {
+	char requests[REQUEST_SIZE * MAX_PIPELINE];
+	char buffer[BUFFER_SIZE];
+
+	for (int r = 0; r < load.pipeline; r += 1) {
+		memcpy(requests + r * REQUEST_SIZE, request, REQUEST_SIZE);
+	}
+
+	int fd = connect_to(&load.addr);
+	if (fd < 0) {
+		results.errors += 1;
+		return;
+	}
+
+	size_t length = 0;
+	while (routines_clock() < load.deadline) {
+		/* Send the whole pipeline at once */
+		uint64_t sent = routines_clock();
+		size_t size = REQUEST_SIZE * load.pipeline;
+		for (size_t written = 0; written < size; ) {
+			ssize_t bytes = send(
+				fd,
+				requests + written,
+				size - written,
+				MSG_DONTWAIT | MSG_NOSIGNAL
+			);
+			if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				routines_wait_fd(fd, EPOLLOUT, NULL);
+			} else if (bytes < 0 && errno != EINTR) {
+				goto failed;
+			} else if (bytes > 0) {
+				written += bytes;
+			}
+		}
+
+		/* Wait for a response to every request */
+		for (int pending = load.pipeline; pending > 0; ) {
+			size_t response = response_size(buffer, length);
+			if (response > 0) {
+				histogram_record(&results.latency, routines_clock() - sent);
+				results.requests += 1;
+				pending -= 1;
+
+				length -= response;
+				memmove(buffer, buffer + response, length);
+				continue;
+			}
+
+			if (length == BUFFER_SIZE) {
+				goto failed;
+			}
+
+			ssize_t bytes = recv(
+				fd,
+				buffer + length,
+				BUFFER_SIZE - length,
+				MSG_DONTWAIT
+			);
+			if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				routines_wait_fd(fd, EPOLLIN, NULL);
+			} else if (bytes == 0 || (bytes < 0 && errno != EINTR)) {
+				goto failed;
+			} else if (bytes > 0) {
+				length += bytes;
+			}
+		}
+	}
+
+	close(fd);
+	return;
+
+failed:
+	results.errors += 1;
+	close(fd);
+}
+
+static int connect_to(const struct sockaddr_in *addr) {
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (fd < 0) {
+		return -1;
+	}
+
+	int nodelay = true;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+	if (connect(fd, (const struct sockaddr *)addr, sizeof(*addr)) < 0) {
+		if (errno != EINPROGRESS) {
+			close(fd);
+			return -1;
+		}
+
+		int error = 0;
+		socklen_t size = sizeof(error);
+		routines_wait_fd(fd, EPOLLOUT, NULL);
+		getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &size);
+		if (error != 0) {
+			close(fd);
+			return -1;
+		}
+	}
+
+	return fd;
+}
+
+static size_t response_size(const char *buffer, size_t length) {
+	const char *end = memmem(buffer, length, "\r\n\r\n", 4);
+	if (end == NULL) {
+		return 0;
+	}
+	size_t headers = end + 4 - buffer;
+
+	const char *field = memmem(buffer, headers, "Content-Length:", 15);
+	size_t body = field == NULL ? 0 : strtoul(field + 15, NULL, 10);
+
+	return headers + body <= length ? headers + body : 0;
+}
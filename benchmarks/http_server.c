@@ -0,0 +1,360 @@
+/*
+ * HTTP/1.1 server benchmark with keep-alive and pipelining
+ *
+ * Each connection is handled by a worker co-routine which waits for
+ * requests in the reactor, answers every complete request it has read
+ * with a single writev, and holds a read buffer only while a request is
+ * partially read. Together with http_load it measures the throughput of
+ * the library end to end.
+ *
+ * Author:  Curtis Millar
+ * Date:    11 October 2019
+ * Licence: MIT
+ */
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <routines.h>
+
+#define LISTEN_PORT     8080
+#define LISTEN_BACKLOG  4096
+#define MAX_CONNECTIONS 100000
+
+/* Bytes of request headers that can be buffered */
+#define BUFFER_SIZE 4096
+
+/* Pipelined requests answered by one writev */
+#define MAX_PIPELINE 64
+
+#define TRY(e) { \
+	if ((e) < 0) { \
+		perror(#e); \
+		exit(EXIT_FAILURE); \
+	} \
+}
+
+/* A response sent as-is from static storage */
+typedef struct {
+	const char *data;
+	size_t size;
+} response_t;
+
+#define RESPONSE(text) { text, sizeof(text) - 1 }
+
+static const response_t hello = RESPONSE(
+	"HTTP/1.1 200 OK\r\n"
+	"Content-Type: text/plain\r\n"
+	"Content-Length: 13\r\n"
+	"\r\n"
+	"Hello, World!"
+);
+
+static const response_t not_found = RESPONSE(
+	"HTTP/1.1 404 Not Found\r\n"
+	"Content-Type: text/plain\r\n"
+	"Content-Length: 9\r\n"
+	"\r\n"
+	"Not Found"
+);
+
+static const response_t bad_request = RESPONSE(
+	"HTTP/1.1 400 Bad Request\r\n"
+	"Content-Length: 0\r\n"
+	"Connection: close\r\n"
+	"\r\n"
+);
+
+/* Read buffers shared by connections with a request in progress */
+static routines_buffers_t *buffers;
+
+/* Accept connections and hand each to a worker */
+static void accept_connections(void *arg);
+
+/* Serve requests on a connection until it is closed */
+static void handle_connection(void *arg);
+
+/*
+ * Parse the request at the start of a buffer
+ *
+ * Returns the length of the request, or 0 if it is incomplete. Stores
+ * the response and whether the connection closes after it.
+ */
+static size_t parse_request(
+	const char *request,
+	size_t length,
+	const response_t **response,
+	bool *close
+);
+
+/* Write every buffer, waiting while the socket is full */
+static bool write_all(int fd, struct iovec *iov, int count);
+
+int main(int argc, char **argv) {
+	int port = argc > 1 ? atoi(argv[1]) : LISTEN_PORT;
+
+	int listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	TRY(listen_fd);
+	int reuseaddr = true;
+	TRY(setsockopt(
+		listen_fd,
+		SOL_SOCKET,
+		SO_REUSEADDR,
+		&reuseaddr,
+		sizeof(reuseaddr)
+	));
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(port),
+		.sin_addr = (struct in_addr) {htonl(INADDR_ANY)},
+	};
+	TRY(bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)));
+	TRY(listen(listen_fd, LISTEN_BACKLOG));
+
+	buffers = routines_buffers_create(BUFFER_SIZE, 0);
+	routines_pool_t *workers = routines_pool_create(
+		handle_connection,
+		0,
+		MAX_CONNECTIONS
+	);
+	assert(buffers != NULL && workers != NULL);
+
+	routines_log("[ROOT] Listening on port %d\n", port);
+
+	void *args[] = {(void *)(intptr_t)listen_fd, workers};
+	routines_coroutine_t *acceptor = routines_spawn(
+		accept_connections,
+		args
+	);
+	assert(acceptor != NULL);
+
+	while (routines_poll());
+
+	routines_destroy(acceptor);
+	routines_pool_destroy(workers);
+	routines_buffers_destroy(buffers);
+	close(listen_fd);
+	return EXIT_SUCCESS;
+}
+
+static void accept_connections(void *arg) {
+	void **args = arg;
+	int listen_fd = (intptr_t)args[0];
+	routines_pool_t *workers = args[1];
+
+	while (true) {
+		int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK);
+		if (fd < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				routines_wait_fd(listen_fd, EPOLLIN, NULL);
+			} else if (errno != EINTR && errno != ECONNABORTED) {
+				routines_log("[ACCEPT] %s\n", strerror(errno));
+				routines_sleep(10000000);
+			}
+			continue;
+		}
+
+		int nodelay = true;
+		setsockopt(
+			fd,
+			IPPROTO_TCP,
+			TCP_NODELAY,
+			&nodelay,
+			sizeof(nodelay)
+		);
+
+		/* Work must not be NULL, which descriptor 0 would be */
+		void *work = (void *)(intptr_t)(fd + 1);
+		if (routines_pool_submit(workers, work) != 0) {
+			close(fd);
+		}
+	}
+}
+
+static void handle_connection(void *arg) {
+	int fd = (intptr_t)arg - 1;
+	char *buffer = NULL;
+	size_t length = 0;
+	bool open = true;
+
+	while (open) {
+		if (buffer == NULL) {
+			/* Idle connections hold no buffer */
+			ssize_t bytes = routines_read_pooled(
+				fd,
+				buffers,
+				(void **)&buffer
+			);
+			if (bytes <= 0) {
+				break;
+			}
+			length = bytes;
+		} else {
+			if (length == BUFFER_SIZE) {
+				break;
+			}
+
+			ssize_t bytes = recv(
+				fd,
+				buffer + length,
+				BUFFER_SIZE - length,
+				MSG_DONTWAIT
+			);
+			if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				routines_wait_fd(fd, EPOLLIN, NULL);
+				continue;
+			} else if (bytes < 0 && errno == EINTR) {
+				continue;
+			} else if (bytes <= 0) {
+				break;
+			}
+			length += bytes;
+		}
+
+		/*
+		 * Answer every complete request read so far, with one write for
+		 * each batch of responses, before reading any more
+		 */
+		size_t parsed = 0;
+		bool written = true;
+		int responses = MAX_PIPELINE;
+		while (open && written && responses == MAX_PIPELINE) {
+			struct iovec iov[MAX_PIPELINE];
+			responses = 0;
+			while (open && responses < MAX_PIPELINE) {
+				const response_t *response;
+				bool close_after;
+				size_t size = parse_request(
+					buffer + parsed,
+					length - parsed,
+					&response,
+					&close_after
+				);
+				if (size == 0) {
+					break;
+				}
+
+				iov[responses] = (struct iovec) {
+					.iov_base = (void *)response->data,
+					.iov_len = response->size,
+				};
+				responses += 1;
+				parsed += size;
+				open = !close_after;
+			}
+
+			if (responses > 0) {
+				written = write_all(fd, iov, responses);
+			}
+		}
+		if (!written) {
+			break;
+		}
+
+		/* Keep any partial request for the next read */
+		length -= parsed;
+		if (length == 0) {
+			routines_buffer_release(buffers, buffer);
+			buffer = NULL;
+		} else if (parsed > 0) {
+			memmove(buffer, buffer + parsed, length);
+		}
+	}
+
+	routines_buffer_release(buffers, buffer);
+	close(fd);
+}
+
+static size_t parse_request(
+	const char *request,
+	size_t length,
+	const response_t **response,
+	bool *close
+) {
+	const char *end = memmem(request, length, "\r\n\r\n", 4);
+	if (end == NULL) {
+		return 0;
+	}
+	size_t size = end + 4 - request;
+
+	/* Request line of the form "GET /path HTTP/1.1" */
+	const char *line_end = memchr(request, '\r', size);
+	const char *path = memchr(request, ' ', line_end - request);
+	const char *version = path == NULL
+		? NULL
+		: memchr(path + 1, ' ', line_end - path - 1);
+	if (
+		version == NULL
+		|| line_end - version != 9
+		|| memcmp(version + 1, "HTTP/1.", 7) != 0
+	) {
+		*response = &bad_request;
+		*close = true;
+		return size;
+	}
+
+	/* Bodies are not read so only requests without one are served */
+	bool bodiless = memmem(request, size, "Content-Length:", 15) == NULL
+		&& memmem(request, size, "Transfer-Encoding:", 18) == NULL;
+	if (!bodiless) {
+		*response = &bad_request;
+		*close = true;
+		return size;
+	}
+
+	/* HTTP/1.0 closes unless asked to keep the connection alive */
+	bool http10 = version[8] == '0';
+	if (http10) {
+		*close = memmem(request, size, "Connection: keep-alive", 22) == NULL;
+	} else {
+		*close = memmem(request, size, "Connection: close", 17) != NULL;
+	}
+
+	size_t path_length = version - path - 1;
+	if (path_length == 1 && path[1] == '/') {
+		*response = &hello;
+	} else {
+		*response = &not_found;
+	}
+	return size;
+}
+
+static bool write_all(int fd, struct iovec *iov, int count) {
+	while (count > 0) {
+		ssize_t written = writev(fd, iov, count);
+		if (written < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				routines_wait_fd(fd, EPOLLOUT, NULL);
+				continue;
+			} else if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+
+		/* Skip whatever was written, which may end mid-buffer */
+		while (count > 0 && (size_t)written >= iov->iov_len) {
+			written -= iov->iov_len;
+			iov += 1;
+			count -= 1;
+		}
+		if (count > 0) {
+			iov->iov_base = (char *)iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+
+	return true;
+}
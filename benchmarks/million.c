@@ -0,0 +1,203 @@
+/*
+ * Idle co-routine footprint benchmark
+ *
+ * Spawns a large number of co-routines that each wait on a queue of
+ * their own, as an actor waits on its mailbox, then wakes them all.
+ * Reports how quickly co-routines can be spawned and woken, and how much
+ * memory and how many memory mappings each idle co-routine costs.
+ *
+ * Usage: million [co-routines]
+ *
+ * Each stack has a guard page, taking two of the memory mappings allowed
+ * by vm.max_map_count, so a million co-routines need that raised above
+ * two million. Built with ROUTINES_NO_GUARD_PAGES, stacks are mapped in
+ * chunks that the kernel merges and mappings per co-routine should be
+ * near zero.
+ *
+ * Author:  Curtis Millar
+ * Date:    11 October 2019
+ * Licence: MIT
+ */
+
+#include <assert.h>
+#include <malloc.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <routines.h>
+
+#define DEFAULT_COROUTINES 1000000
+
+/* Memory in use by the process */
+typedef struct {
+	/* Resident bytes */
+	size_t rss;
+	/* Bytes allocated from the heap */
+	size_t heap;
+	/* Memory mappings */
+	size_t vmas;
+} usage_t;
+
+/* Wait for a single message then complete */
+static void idle(void *arg);
+
+/* Measure the memory in use by the process */
+static void measure(usage_t *usage);
+
+/* Count the lines of a file */
+static size_t count_lines(const char *path);
+
+/* Print one result with its unit */
+static void report(const char *label, double value, const char *unit);
+
+int main(int argc, char **argv) {
+	size_t count = argc > 1 ? atol(argv[1]) : DEFAULT_COROUTINES;
+	if (count == 0) {
+		fprintf(stderr, "usage: %s [co-routines]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	/* Handles are touched up front so they are not counted as overhead */
+	routines_queue_t **queues = calloc(count, sizeof(*queues));
+	routines_coroutine_t **coroutines = calloc(count, sizeof(*coroutines));
+	assert(queues != NULL && coroutines != NULL);
+	memset(queues, 0, count * sizeof(*queues));
+	memset(coroutines, 0, count * sizeof(*coroutines));
+
+	usage_t before;
+	measure(&before);
+
+	/* Queues */
+	uint64_t start = routines_clock();
+	for (size_t q = 0; q < count; q += 1) {
+		queues[q] = routines_queue_create();
+		if (queues[q] == NULL) {
+			perror("routines_queue_create");
+			return EXIT_FAILURE;
+		}
+	}
+	uint64_t queued = routines_clock();
+
+	usage_t with_queues;
+	measure(&with_queues);
+
+	/* Co-routines, each of which runs until it blocks when spawned */
+	size_t spawned = 0;
+	uint64_t spawning = routines_clock();
+	for (; spawned < count; spawned += 1) {
+		int error = routines_spawn_ex(
+			&coroutines[spawned],
+			idle,
+			queues[spawned]
+		);
+		if (error != 0) {
+			fprintf(
+				stderr,
+				"stopped after %zu co-routines: %s"
+				" (check ulimit -v and vm.max_map_count)\n",
+				spawned,
+				strerror(error)
+			);
+			break;
+		}
+	}
+	routines_yield();
+	uint64_t started = routines_clock();
+
+	usage_t with_coroutines;
+	measure(&with_coroutines);
+
+	/* Wake every co-routine and run each to completion */
+	uint64_t waking = routines_clock();
+	for (size_t c = 0; c < spawned; c += 1) {
+		routines_signal(queues[c], NULL);
+	}
+	routines_yield();
+	uint64_t woken = routines_clock();
+
+	for (size_t c = 0; c < spawned; c += 1) {
+		assert(routines_state(coroutines[c]) == ROUTINES_COMPLETED);
+	}
+
+	uint64_t destroying = routines_clock();
+	for (size_t c = 0; c < spawned; c += 1) {
+		routines_destroy(coroutines[c]);
+	}
+	for (size_t q = 0; q < count; q += 1) {
+		routines_queue_destroy(queues[q]);
+	}
+	uint64_t destroyed = routines_clock();
+
+	double queue_bytes = (double)(with_queues.heap - before.heap) / count;
+	double block_bytes
+		= (double)(with_coroutines.heap - with_queues.heap) / spawned;
+	double stack_bytes = (
+		(double)(with_coroutines.rss - with_queues.rss)
+		- (double)(with_coroutines.heap - with_queues.heap)
+	) / spawned;
+	double total_bytes
+		= (double)(with_coroutines.rss - before.rss) / spawned;
+
+	printf("%zu idle co-routines\n", spawned);
+	report("queue create", count / ((queued - start) / 1e9), "/s");
+	report("spawn", spawned / ((started - spawning) / 1e9), "/s");
+	report("wake all", (woken - waking) / 1e6, "ms");
+	report("wake", spawned / ((woken - waking) / 1e9), "/s");
+	report("destroy", spawned / ((destroyed - destroying) / 1e9), "/s");
+	report("queue", queue_bytes, "bytes");
+	report("control block", block_bytes, "bytes");
+	report("stack resident", stack_bytes, "bytes");
+	report("total resident", total_bytes, "bytes");
+	report(
+		"mappings",
+		(double)(with_coroutines.vmas - with_queues.vmas) / spawned,
+		"per co-routine"
+	);
+	report("mappings", with_coroutines.vmas, "in total");
+
+	free(queues);
+	free(coroutines);
+	return EXIT_SUCCESS;
+}
+
+static void idle(void *arg) {
+	routines_wait(arg);
+}
+
+static void measure(usage_t *usage) {
+	size_t pages = 0;
+	FILE *statm = fopen("/proc/self/statm", "r");
+	if (statm != NULL) {
+		if (fscanf(statm, "%*u %zu", &pages) != 1) {
+			pages = 0;
+		}
+		fclose(statm);
+	}
+
+	struct mallinfo2 heap = mallinfo2();
+	*usage = (usage_t) {
+		.rss = pages * sysconf(_SC_PAGESIZE),
+		.heap = heap.uordblks + heap.hblkhd,
+		.vmas = count_lines("/proc/self/maps"),
+	};
+}
+
+static size_t count_lines(const char *path) {
+	FILE *file = fopen(path, "r");
+	if (file == NULL) {
+		return 0;
+	}
+
+	size_t lines = 0;
+	for (int c = fgetc(file); c != EOF; c = fgetc(file)) {
+		lines += c == '\n';
+	}
+	fclose(file);
+	return lines;
+}
+
+static void report(const char *label, double value, const char *unit) {
+	printf("%-16s %14.1f %s\n", label, value, unit);
+}
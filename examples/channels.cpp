@@ -0,0 +1,72 @@
+/*
+ * Typed channels with the C++ interface
+ *
+ * Author:  Curtis Millar
+ * Date:    11 October 2019
+ * Licence: MIT
+ */
+
+#include <coroutine>
+#include <cstdio>
+#include <string>
+#include <routines.hpp>
+
+#define NUM_WORDS 5
+
+/* A C++ coroutine that runs until completion without being awaited */
+struct detached {
+	struct promise_type {
+		detached get_return_object() noexcept {
+			return {};
+		}
+		std::suspend_never initial_suspend() noexcept {
+			return {};
+		}
+		std::suspend_never final_suspend() noexcept {
+			return {};
+		}
+		void return_void() noexcept {}
+		void unhandled_exception() noexcept {}
+	};
+};
+
+/* Count the words arriving on a channel from a C++ coroutine */
+static detached count_words(routines::Queue<std::string> &words, int &count) {
+	for (int w = 0; w < NUM_WORDS; w += 1) {
+		std::string word = co_await words;
+		count += 1;
+		std::printf("[COUNTER] Word #%d: %s\n", count, word.c_str());
+	}
+}
+
+int main() {
+	routines::Queue<int> lengths;
+	routines::Queue<std::string> words;
+	routines::Queue<std::string> counted;
+	int count = 0;
+
+	/* Measure each word, replying with its length */
+	auto measurer = routines::Coroutine::spawn([&] {
+		while (true) {
+			routines_queue_t *reply;
+			std::string word = words.recv(reply);
+			std::printf("[MEASURER] Measuring: %s\n", word.c_str());
+			counted.signal(word);
+			routines::reply<int>(reply, word.size());
+		}
+	});
+
+	count_words(counted, count);
+
+	auto speaker = routines::Coroutine::spawn([&] {
+		const char *sentence[NUM_WORDS] = {
+			"the", "quick", "brown", "fox", "jumps",
+		};
+		for (const char *word : sentence) {
+			int length = words.call(std::string(word), lengths);
+			std::printf("[SPEAKER] '%s' has %d letters\n", word, length);
+		}
+	});
+
+	std::printf("[ROOT] Counted %d words\n", count);
+}
@@ -26,6 +26,9 @@
 #define LISTEN_PORT    1234
 #define LISTEN_BACKLOG 128
 
+#define BUFFER_SIZE 4096
+#define ECHO_PREFIX "ECHO: "
+
 #define TRY(e) { \
 	if (e < 0) { \
 		perror(#e); \
@@ -53,6 +56,9 @@ struct server {
 	/* Coroutine for connection handling */
 	routines_coroutine_t *connection_listener;
 
+	/* Buffers shared by connections with a message to handle */
+	routines_buffers_t *buffers;
+
 	/* Exited connections */
 	connection_t *exited;
 };
@@ -158,6 +164,10 @@ static void server_start(server_t *server) {
 	/* Server exited queue */
 	server->exited = NULL;
 
+	/* Idle connections hold no buffer */
+	server->buffers = routines_buffers_create(BUFFER_SIZE, 0);
+	assert(server->buffers != NULL);
+
 	/* start listening co-routine */
 	server->connection_listener = routines_spawn(
 		listen_for_connections,
@@ -173,6 +183,7 @@ static void server_stop(server_t *server) {
 	close(server->epoll_fd);
 	exited_drain(&server->exited);
 	routines_destroy(server->connection_listener);
+	routines_buffers_destroy(server->buffers);
 }
 
 static void server_poll(server_t *server) {
@@ -184,8 +195,16 @@ static void server_poll(server_t *server) {
 }
 
 static void server_poll_once(server_t *server) {
+	/* Wake in time for sleeping co-routines, such as the log writer */
+	int timeout = -1;
+	uint64_t deadline;
+	if (routines_next_deadline(&deadline)) {
+		uint64_t now = routines_clock();
+		timeout = deadline > now ? (deadline - now + 999999) / 1000000 : 0;
+	}
+
 	struct epoll_event events[32];
-	int num_events = epoll_wait(server->epoll_fd, events, 32, -1);
+	int num_events = epoll_wait(server->epoll_fd, events, 32, timeout);
 	TRY(num_events);
 
 	for (size_t e = 0; e < num_events; e += 1) {
@@ -231,7 +250,7 @@ static void listen_for_connections(void *arg) {
 		);
 		TRY(peer_fd);
 
-		printf("[CONN] New connection on #%d\n", peer_fd);
+		routines_log("[CONN] New connection on #%d\n", peer_fd);
 		new_connection(server, peer_fd);
 		server_wait(server, server->listen_fd, EPOLLIN);
 	}
@@ -239,21 +258,38 @@ static void listen_for_connections(void *arg) {
 
 static void handle_connection(void *arg) {
 	connection_t *connection = arg;
-	char buffer[4096] = "ECHO: ";
+	routines_buffers_t *buffers = connection->server->buffers;
+	size_t prefix = strlen(ECHO_PREFIX);
+	bool exiting = false;
 
-	printf("[CLIENT #%d] Listening\n", connection->fd);
-	server_wait(connection->server, connection->fd, EPOLLIN);
-	while (strcmp(buffer + 6, "exit\n") != 0) {
-		ssize_t bytes = read(connection->fd, buffer + 6, 4089);
+	routines_log("[CLIENT #%d] Listening\n", connection->fd);
+	while (!exiting) {
+		/* Take a buffer only once there is a message to read */
+		server_wait(connection->server, connection->fd, EPOLLIN);
+		char *buffer = routines_buffer_take(buffers);
+		assert(buffer != NULL);
+
+		memcpy(buffer, ECHO_PREFIX, prefix);
+		ssize_t bytes = read(
+			connection->fd,
+			buffer + prefix,
+			BUFFER_SIZE - prefix - 1
+		);
 		TRY(bytes);
-		buffer[6 + bytes] = 0;
-		printf("[CLIENT #%d] Message: %s\n", connection->fd, buffer + 6);
+		buffer[prefix + bytes] = 0;
+		routines_log(
+			"[CLIENT #%d] Message: %s\n",
+			connection->fd,
+			buffer + prefix
+		);
+		exiting = bytes == 0 || strcmp(buffer + prefix, "exit\n") == 0;
+
 		server_wait(connection->server, connection->fd, EPOLLOUT);
-		write(connection->fd, buffer, strlen(buffer));
-		server_wait(connection->server, connection->fd, EPOLLIN);
+		write(connection->fd, buffer, prefix + bytes);
+		routines_buffer_release(buffers, buffer);
 	}
 
-	printf("[CLIENT #%d] Closing\n", connection->fd);
+	routines_log("[CLIENT #%d] Closing\n", connection->fd);
 	shutdown(connection->fd, SHUT_RDWR);
 	close(connection->fd);
 
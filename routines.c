@@ -6,15 +6,135 @@
  * Licence: MIT
  */
 
+#define _GNU_SOURCE
+
 #include <assert.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <link.h>
+#include <malloc.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <setjmp.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <routines.h>
 
+/*
+ * Build configuration
+ *
+ * Building with ROUTINES_STATIC takes all control blocks, stacks and
+ * messages from fixed-size static arrays rather than from malloc and
+ * mmap. The capacity of each array is set at compile time.
+ */
+
+#ifndef STACK_SIZE
 #define STACK_SIZE (4096 * 8)
+#endif
+
+/* Stacks mapped at once when a thread has none unused */
+#ifndef ROUTINES_STACK_CHUNK
+#define ROUTINES_STACK_CHUNK 64
+#endif
+
+#ifndef ROUTINES_MAX_COROUTINES
+#define ROUTINES_MAX_COROUTINES 64
+#endif
+
+#ifndef ROUTINES_MAX_QUEUES
+#define ROUTINES_MAX_QUEUES 64
+#endif
+
+#ifndef ROUTINES_MAX_MESSAGES
+#define ROUTINES_MAX_MESSAGES 256
+#endif
+
+#ifndef ROUTINES_MAX_POOLS
+#define ROUTINES_MAX_POOLS 4
+#endif
+
+#ifndef ROUTINES_MAX_RATELIMITS
+#define ROUTINES_MAX_RATELIMITS 4
+#endif
+
+#ifndef ROUTINES_MAX_SCHEDULERS
+#define ROUTINES_MAX_SCHEDULERS 8
+#endif
+
+#ifndef ROUTINES_MAX_BUFFER_POOLS
+#define ROUTINES_MAX_BUFFER_POOLS 4
+#endif
+
+#ifndef ROUTINES_MAX_SOURCES
+#define ROUTINES_MAX_SOURCES 8
+#endif
+
+/* Bytes in each of the two log buffers of a thread */
+#ifndef ROUTINES_LOG_BYTES
+#define ROUTINES_LOG_BYTES 16384
+#endif
+
+/* Bytes shared by the buffers of every buffer pool */
+#ifndef ROUTINES_BUFFER_BYTES
+#define ROUTINES_BUFFER_BYTES (4096 * 16)
+#endif
+
+/* Helper threads allocate their own stacks so are off by default */
+#ifndef ROUTINES_HELPER_THREADS
+#ifdef ROUTINES_STATIC
+#define ROUTINES_HELPER_THREADS 0
+#else
+#define ROUTINES_HELPER_THREADS (-1)
+#endif
+#endif
+
+/* File I/O threads spend their time blocked so aren't sized by processor */
+#ifndef ROUTINES_IO_THREADS
+#ifdef ROUTINES_STATIC
+#define ROUTINES_IO_THREADS 0
+#else
+#define ROUTINES_IO_THREADS 4
+#endif
+#endif
+
+/* Datagrams sent in one sendmmsg, also the kernel's limit on segments */
+#define DATAGRAM_BATCH 64
+
+/* Largest UDP payload that can be segmented by the kernel */
+#define DATAGRAM_GSO_BYTES 65507
+
+/* Wait on a pidfd, missing from older C libraries */
+#ifndef P_PIDFD
+#define P_PIDFD 3
+#endif
+
+_Static_assert(STACK_SIZE % 4096 == 0, "STACK_SIZE must be page aligned");
+_Static_assert(ROUTINES_STACK_CHUNK > 0, "no stacks per chunk");
+_Static_assert(ROUTINES_MAX_COROUTINES > 0, "no co-routines configured");
+_Static_assert(ROUTINES_MAX_QUEUES > 0, "no queues configured");
+_Static_assert(ROUTINES_MAX_MESSAGES > 0, "no messages configured");
 
 /* A message from a routine queue */
 typedef struct message {
@@ -47,6 +167,8 @@ struct routines_queue {
 struct routines_coroutine {
 	/* Entrypoint function for co-routine */
 	routines_task_t entrypoint;
+	/* Entrypoint function for co-routine returning a result */
+	routines_function_t function;
 	/* Arguments to pass when starting the co-routine */
 	void *arg;
 	/* Stack address of co-routine */
@@ -61,49 +183,533 @@ struct routines_coroutine {
 	routines_state_t state;
 	/* Co-routines waiting on this routine */
 	coroutine_queue_t join_queue;
+	/* Result returned by a function entrypoint */
+	void *result;
+	/* Result of the co-routine that was joined */
+	void *join_result;
+
+	/* Message handed straight to the routine while it was receiving */
+	struct {
+		bool ready;
+		void *message;
+		routines_queue_t *reply_queue;
+		/* Waiting for the reply to a call */
+		bool calling;
+	} handoff;
 
 	/* Message queue entry where blocked */
 	routines_coroutine_t **message;
 	/* Receive queue qhere blocked */
 	coroutine_queue_t *queue;
 
+	/* Clock time at which a sleeping routine wakes */
+	uint64_t deadline;
+
+	/* File descriptor where blocked waiting for events */
+	int wait_fd;
+	/* Events that woke a routine waiting on a file descriptor */
+	uint32_t revents;
+	/* Waiting for an I/O thread to complete a file operation */
+	bool file_io;
+	/* Destroyed as soon as it completes */
+	bool detached;
+
+	/* Scheduler that owns the routine */
+	routines_scheduler_t *scheduler;
+
 	/* Previous routine in ready / block queue */
 	routines_coroutine_t *prev;
 	/* Next routine in ready / block queue */
 	routines_coroutine_t *next;
 };
 
-/* Co-routine stack list */
+/* Concrete implementation of a scheduler */
+struct routines_scheduler {
+	/* Protects the incoming queue */
+	pthread_mutex_t lock;
+	/* Co-routines migrated from other schedulers */
+	coroutine_queue_t incoming;
+	/* The incoming queue is not empty */
+	atomic_bool migrated;
+	/* Number of co-routines owned */
+	atomic_size_t load;
+	/* References from the thread and each co-routine owned */
+	atomic_size_t refs;
+	/* File operations completed by I/O threads */
+	struct file_request *completed;
+	/* The completed list is not empty */
+	atomic_bool completions;
+	/* Event counter that wakes the reactor, or -1 before it starts */
+	int wake_fd;
+	/* Next scheduler in the list of all schedulers */
+	routines_scheduler_t *next;
+};
+
+/* A worker co-routine in a pool */
+typedef struct pool_worker {
+	/* Pool the worker takes work from */
+	routines_pool_t *pool;
+	/* Co-routine running the worker */
+	routines_coroutine_t *coroutine;
+	/* Previous worker in live / retired list */
+	struct pool_worker *prev;
+	/* Next worker in live / retired list */
+	struct pool_worker *next;
+} pool_worker_t;
+
+/* Concrete implementation of a worker pool */
+struct routines_pool {
+	/* Function run for each piece of work */
+	routines_task_t task;
+	/* Bounds on the number of live workers */
+	size_t min_workers;
+	size_t max_workers;
+	/* Queue of submitted work */
+	routines_queue_t *queue;
+	/* Workers that may still take work */
+	pool_worker_t *live;
+	/* Workers that have completed but not yet been destroyed */
+	pool_worker_t *retired;
+	/* Utilisation */
+	routines_pool_stats_t stats;
+};
+
+/* Work run on a helper thread */
+typedef struct helper_job {
+	/* Function to run */
+	void (*run)(void *);
+	/* Argument to pass to the function */
+	void *arg;
+	/* The job has been run or cancelled */
+	bool done;
+	/* The job reports its own completion and is never waited for */
+	bool detached;
+	/* Next job in helper queue */
+	struct helper_job *next;
+} helper_job_t;
+
+/* A set of helper threads taking jobs from a shared queue */
+typedef struct {
+	pthread_mutex_t lock;
+	/* Signalled when a job is queued */
+	pthread_cond_t queued;
+	/* Signalled when a job is done */
+	pthread_cond_t done;
+	/* Queue of jobs waiting for a thread */
+	helper_job_t *head;
+	helper_job_t **tail;
+	/* Threads to start, or -1 for one per processor after the first */
+	long configured;
+	/* Threads have been started */
+	bool started;
+	/* Number of helper threads */
+	size_t threads;
+} helper_pool_t;
+
+/* Initialiser for a set of helper threads */
+#define HELPER_POOL(name, count) { \
+	.lock = PTHREAD_MUTEX_INITIALIZER, \
+	.queued = PTHREAD_COND_INITIALIZER, \
+	.done = PTHREAD_COND_INITIALIZER, \
+	.head = NULL, \
+	.tail = &name.head, \
+	.configured = count, \
+	.started = false, \
+	.threads = 0, \
+}
+
+/* A file operation run by an I/O thread */
+typedef struct file_request {
+	/* Job run by the I/O thread */
+	helper_job_t job;
+	/* Operation and its arguments */
+	enum {
+		FILE_PREAD,
+		FILE_PWRITE,
+		FILE_FSYNC,
+		FILE_FDATASYNC,
+		FILE_WRITE,
+	} operation;
+	int fd;
+	void *buf;
+	size_t count;
+	off_t offset;
+	/* Return value and errno of the operation */
+	ssize_t result;
+	int error;
+	/* Co-routine waiting for the operation and its scheduler */
+	routines_coroutine_t *coroutine;
+	routines_scheduler_t *scheduler;
+	/* The operation has completed, set by the scheduler */
+	bool done;
+	/* Next request in the scheduler's completed list */
+	struct file_request *next;
+} file_request_t;
+
+/* A loop split across helper threads */
+typedef struct {
+	/* Range of indices */
+	size_t begin;
+	size_t end;
+	/* Indices per chunk */
+	size_t grain;
+	/* Number of chunks in the range */
+	size_t chunks;
+	/* Next chunk to be run */
+	atomic_size_t next_chunk;
+	/* Function to call for each chunk of a loop */
+	routines_range_t fn;
+	/* Function to call for each chunk of a reduction */
+	routines_map_t map;
+	/* Function to combine the results of a reduction */
+	routines_combine_t combine;
+	/* Result of each chunk of a reduction run on many threads */
+	void **results;
+	/* Combined result of a reduction run on one thread */
+	void *result;
+	/* Context to pass to each chunk */
+	void *ctx;
+	/* Helper jobs still running for a waiting co-routine */
+	atomic_size_t running;
+	/* Reports the last helper job to finish to a waiting co-routine */
+	file_request_t finished;
+} parallel_t;
+
+/* Concrete implementation of a rate limiter */
+struct routines_ratelimit {
+	/* Tokens gained per second */
+	double rate;
+	/* Most tokens held at once */
+	double burst;
+	/* Tokens held, negative when already promised to sleepers */
+	double tokens;
+	/* Clock time tokens were last added */
+	uint64_t updated;
+};
+
+/*
+ * I/O buffer list
+ *
+ * Stored at the start of each unused buffer.
+ */
+typedef struct buffer {
+	struct buffer *next;
+} buffer_t;
+
+/* Concrete implementation of a buffer pool */
+struct routines_buffers {
+	/* Bytes in each buffer */
+	size_t size;
+	/* Most buffers allocated at once, or 0 for no limit */
+	size_t max;
+	/* Buffers allocated, whether taken or unused */
+	size_t allocated;
+	/* Buffers released for reuse */
+	buffer_t *unused;
+	size_t unused_count;
+	/* Co-routines waiting for a buffer to be released */
+	coroutine_queue_t waiting;
+};
+
+/* Concrete implementation of an event source */
+struct routines_source {
+	/* Kind of file descriptor being read */
+	enum {
+		SOURCE_SIGNAL,
+		SOURCE_TIMER,
+		SOURCE_EVENT,
+		SOURCE_CHILD,
+	} kind;
+	/* File descriptor producing events */
+	int fd;
+	/* Queue to which events are sent */
+	routines_queue_t *queue;
+	/* Co-routine reading events */
+	routines_coroutine_t *reader;
+};
+
+/*
+ * Log records of a thread
+ *
+ * Records are appended to one buffer while the other is written, so
+ * that logging only blocks once both are full.
+ */
+typedef struct {
+	char buffers[2][ROUTINES_LOG_BYTES];
+	/* Buffer to which records are appended */
+	int active;
+	/* Bytes of records in the active buffer */
+	size_t used;
+	/* Clock time of the first record in the active buffer */
+	uint64_t first;
+	/* Bytes of records in the other buffer waiting to be written */
+	size_t pending;
+	/* The other buffer is being written */
+	bool writing;
+	/* Co-routine writing records once a batch is due */
+	routines_coroutine_t *writer;
+	/* Co-routines waiting for a buffer to be written */
+	coroutine_queue_t waiting;
+} log_t;
+
+/* Concrete implementation of a checkpoint */
+struct routines_checkpoint {
+	/* Co-routines in the checkpoint */
+	routines_coroutine_t **coroutines;
+	/* Bytes of each co-routine argument to save */
+	size_t *sizes;
+	/* Number of co-routines in the checkpoint */
+	size_t count;
+	/* Capacity of the co-routine arrays */
+	size_t capacity;
+	/* Mapping of a restored checkpoint file */
+	void *mapping;
+	size_t mapping_size;
+};
+
+/* Longest object identity kept in a checkpoint */
+#define CHECKPOINT_IDENTITY 32
+
+/* Checkpoint file header */
+typedef struct {
+	/* CHECKPOINT_MAGIC */
+	char magic[8];
+	/* CHECKPOINT_VERSION */
+	uint32_t version;
+	/* Number of co-routine records that follow */
+	uint32_t count;
+} checkpoint_header_t;
+
+/* Checkpoint file co-routine record, followed by its argument */
+typedef struct {
+	/* Offset of the task within its object */
+	uint64_t task_offset;
+	/* Bytes of saved argument */
+	uint64_t size;
+	/* Bytes of the identity of the object */
+	uint32_t identity_size;
+	/* Build ID of the object, or a checksum of its code without one */
+	unsigned char identity[CHECKPOINT_IDENTITY];
+	/* Path of the object containing the task */
+	char object[256];
+} checkpoint_record_t;
+
+#define CHECKPOINT_MAGIC   "ROUTCKPT"
+#define CHECKPOINT_VERSION 2
+
+/* Checkpoint records and arguments are kept aligned */
+#define CHECKPOINT_ALIGN(size) (((size) + 15) & ~(size_t)15)
+
+/*
+ * Co-routine stack list
+ *
+ * Stored at the base of each unused stack.
+ */
 typedef struct stack {
-	unsigned char *stack_base;
 	struct stack *next;
-} stack_t;
+} unused_stack_t;
 
-/* Global state */
+/* A source of fixed-size objects */
+typedef struct {
+	/* Size of each object */
+	size_t size;
+#ifdef ROUTINES_STATIC
+	/* Static storage for objects */
+	unsigned char *slots;
+	/* Number of objects in storage */
+	size_t count;
+	/* Number of objects ever taken from storage */
+	size_t used;
+	/* Objects returned to storage */
+	void *unused;
+	/* Protects the storage from concurrent threads */
+	atomic_flag lock;
+#endif
+} object_slab_t;
+
+/* Declare a source of objects of a given type */
+#ifdef ROUTINES_STATIC
+#define OBJECT_SLAB(name, type, capacity) \
+	static type name##_slots[capacity]; \
+	static object_slab_t name = { \
+		.size = sizeof(type), \
+		.slots = (unsigned char *)name##_slots, \
+		.count = capacity, \
+		.used = 0, \
+		.unused = NULL, \
+		.lock = ATOMIC_FLAG_INIT, \
+	}
+#else
+#define OBJECT_SLAB(name, type, capacity) \
+	static object_slab_t name = { \
+		.size = sizeof(type), \
+	}
+#endif
+
+/*
+ * Scheduler state is local to each thread
+ *
+ * A co-routine may resume on a different thread after being migrated, and
+ * a compiler may keep the address of thread-local state in a register
+ * across setjmp. Work done after a context switch is therefore done in
+ * switched(), which is never inlined so that it finds the state of the
+ * thread it runs on, and no address of thread-local state is held across
+ * a switch.
+ */
+#define THREAD_LOCAL _Thread_local __attribute__((tls_model("initial-exec")))
+
+/* Thread state */
 
 /* The initial task context */
-static struct {
+static THREAD_LOCAL struct {
 	jmp_buf context;
 } root_task;
 
 /* Currently executing co-routine */
-static routines_coroutine_t *current_coroutine;
+static THREAD_LOCAL routines_coroutine_t *current_coroutine;
 
 /* Co-routine that just exited */
-static routines_coroutine_t *exited_coroutine = NULL;
+static THREAD_LOCAL routines_coroutine_t *exited_coroutine = NULL;
 
 /* Queue of ready coroutines */
-static coroutine_queue_t ready_queue;
+static THREAD_LOCAL coroutine_queue_t ready_queue;
+
+/* Queue of sleeping coroutines ordered by deadline */
+static THREAD_LOCAL coroutine_queue_t sleep_queue;
+
+/* Queue of co-routines waiting on file descriptors */
+static THREAD_LOCAL coroutine_queue_t io_queue;
+
+/* Number of file operations waiting for an I/O thread */
+static THREAD_LOCAL size_t file_pending;
+
+/* Log records of this thread, or NULL before the first record */
+static THREAD_LOCAL log_t *thread_log;
+
+/* Where and when log records are written */
+static struct {
+	atomic_int fd;
+	atomic_size_t batch;
+	atomic_uint_fast64_t interval;
+	pthread_once_t exit_once;
+} log_config = {
+	.fd = STDERR_FILENO,
+	.batch = ROUTINES_LOG_BYTES / 2,
+	.interval = 10000000,
+	.exit_once = PTHREAD_ONCE_INIT,
+};
 
 /* Unused stacks */
-static stack_t *unused_stacks;
+static THREAD_LOCAL unused_stack_t *unused_stacks;
+
+#ifndef ROUTINES_STATIC
+/* Stacks mapped in a chunk and never yet used, taken from the top */
+static THREAD_LOCAL unsigned char *reserved_stacks;
+static THREAD_LOCAL size_t reserved_count;
+#endif
+
+/*
+ * File descriptor events
+ *
+ * Each co-routine waiting on a file descriptor is registered with the
+ * thread's epoll instance, where the registration refers to the waiting
+ * co-routine. The scheduler's wake counter and any memory pressure
+ * trigger are registered with the reactor itself.
+ */
+static THREAD_LOCAL struct {
+	/* Epoll instance, or -1 before the reactor starts */
+	int poll_fd;
+	/* Memory pressure trigger, or -1 when not watching */
+	int pressure_fd;
+} reactor = {
+	.poll_fd = -1,
+	.pressure_fd = -1,
+};
+
+/* Scheduler shared with other threads */
+static THREAD_LOCAL routines_scheduler_t *this_scheduler;
+
+/* Global state */
+
+/* All schedulers */
+static struct {
+	pthread_mutex_t lock;
+	/* Releases the scheduler of an exiting thread */
+	pthread_key_t key;
+	pthread_once_t key_once;
+	/* List of schedulers */
+	routines_scheduler_t *head;
+} schedulers = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.key_once = PTHREAD_ONCE_INIT,
+	.head = NULL,
+};
+
+#ifdef ROUTINES_STATIC
+/* Static storage for stacks */
+static unsigned char stack_slots[ROUTINES_MAX_COROUTINES][STACK_SIZE]
+	__attribute__((aligned(4096)));
+
+/* Number of stacks ever taken from storage */
+static atomic_size_t stacks_used;
+#endif
+
+/* Resource limits shared by all threads */
+static struct {
+	/* Current usage of each resource */
+	atomic_size_t usage[ROUTINES_LIMITS];
+	/* Soft and hard limits of each resource, or 0 for none */
+	atomic_size_t soft[ROUTINES_LIMITS];
+	atomic_size_t hard[ROUTINES_LIMITS];
+	/* Protects the handler and its context, which are set together */
+	pthread_mutex_t lock;
+	/* Called when usage rises above a soft limit */
+	routines_overload_t handler;
+	void *ctx;
+} limits = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* Unused stacks are kept in the child of a fork */
+static bool fork_keep_stacks;
+
+/* Fork handlers have been registered */
+static bool fork_registered;
+
+/* Sources of objects */
+OBJECT_SLAB(coroutine_slab, routines_coroutine_t, ROUTINES_MAX_COROUTINES);
+OBJECT_SLAB(queue_slab, routines_queue_t, ROUTINES_MAX_QUEUES);
+OBJECT_SLAB(message_slab, message_t, ROUTINES_MAX_MESSAGES);
+OBJECT_SLAB(pool_slab, routines_pool_t, ROUTINES_MAX_POOLS);
+OBJECT_SLAB(worker_slab, pool_worker_t, ROUTINES_MAX_COROUTINES);
+OBJECT_SLAB(ratelimit_slab, routines_ratelimit_t, ROUTINES_MAX_RATELIMITS);
+OBJECT_SLAB(scheduler_slab, routines_scheduler_t, ROUTINES_MAX_SCHEDULERS);
+OBJECT_SLAB(buffers_slab, routines_buffers_t, ROUTINES_MAX_BUFFER_POOLS);
+OBJECT_SLAB(source_slab, routines_source_t, ROUTINES_MAX_SOURCES);
+OBJECT_SLAB(log_slab, log_t, ROUTINES_MAX_SCHEDULERS);
+
+#ifdef ROUTINES_STATIC
+/* Storage for the buffers of every buffer pool */
+static _Alignas(64) unsigned char buffer_arena[ROUTINES_BUFFER_BYTES];
+static atomic_size_t buffer_arena_used;
+#endif
+
+/* Helper threads for parallel work */
+static helper_pool_t helpers = HELPER_POOL(helpers, ROUTINES_HELPER_THREADS);
+
+/* Helper threads for blocking file I/O */
+static helper_pool_t io_helpers = HELPER_POOL(io_helpers, ROUTINES_IO_THREADS);
 
 /*
  * Message queue managment
  */
 
-/* Add a message to the queue. */
-static void enqueue_message(
+/*
+ * Add a message to the queue.
+ *
+ * Returns ENOMEM if the message could not be allocated.
+ */
+static int enqueue_message(
 	routines_queue_t *queue,
 	void *message,
 	routines_coroutine_t *sender,
@@ -139,20 +745,197 @@ static routines_coroutine_t *coroutine_dequeue(
 /* Remove a co-routine from its queue */
 static void coroutine_remove(routines_coroutine_t *coroutine);
 
+/* Enqueue a sleeping co-routine in deadline order */
+static void sleep_enqueue(routines_coroutine_t *coroutine);
+
+/* Make any co-routines whose deadline has passed ready */
+static void wake_sleepers(void);
+
+/* Add the tokens gained since a bucket was last updated */
+static void ratelimit_refill(routines_ratelimit_t *limit);
+
+/*
+ * Schedulers
+ */
+
+/* Get the scheduler of the calling thread, creating it if needed */
+static routines_scheduler_t *scheduler_self(void);
+
+/* Create the key used to release schedulers */
+static void scheduler_key_create(void);
+
+/* Release the scheduler of an exiting thread */
+static void scheduler_release(void *scheduler);
+
+/* Take a reference to a scheduler for a co-routine it owns */
+static void scheduler_hold(routines_scheduler_t *scheduler);
+
+/* Drop a reference to a scheduler, freeing it after its thread exits */
+static void scheduler_drop(routines_scheduler_t *scheduler);
+
+/* Hand a co-routine to the incoming queue of the scheduler that owns it */
+static void scheduler_enqueue(
+	routines_scheduler_t *scheduler,
+	routines_coroutine_t *coroutine
+);
+
+/* Move co-routines migrated to this thread into the ready queue */
+static void accept_migrated(void);
+
+/* Suspend every co-routine in a scheduler queue */
+static void suspend_all(coroutine_queue_t *queue);
+
+/*
+ * Reactor
+ */
+
+/*
+ * Start the reactor of the calling thread if it isn't running
+ *
+ * Returns 0 on success or an errno value on failure.
+ */
+static int reactor_start(void);
+
+/* Stop the reactor of the calling thread */
+static void reactor_stop(void);
+
+/*
+ * Wait up to `timeout` milliseconds for file descriptor events and make
+ * the co-routines waiting on them ready
+ */
+static void reactor_wait(int timeout);
+
+/*
+ * Wait for events on a file descriptor, in the reactor from a co-routine
+ * or with poll from the initial task
+ *
+ * Returns 0 on success or an errno value on failure.
+ */
+static int fd_wait(int fd, uint32_t events);
+
+/* Send a buffer as datagrams of `segment` bytes with sendmmsg */
+static ssize_t send_segments_batched(
+	int fd,
+	const unsigned char *buf,
+	size_t len,
+	size_t segment,
+	const struct sockaddr *addr,
+	socklen_t addrlen
+);
+
+/*
+ * Checkpoints
+ */
+
+/* An object being searched for by path */
+typedef struct {
+	const char *path;
+	uintptr_t base;
+	unsigned char identity[CHECKPOINT_IDENTITY];
+	size_t identity_size;
+} object_search_t;
+
+/* Find the load address and identity of an object by path */
+static int find_object(struct dl_phdr_info *info, size_t size, void *arg);
+
+/*
+ * Identify the build of a loaded object
+ *
+ * Uses the object's build ID, or a checksum of its executable segments
+ * if it was linked without one. Returns the bytes of identity stored.
+ */
+static size_t object_identity(
+	struct dl_phdr_info *info,
+	unsigned char identity[CHECKPOINT_IDENTITY]
+);
+
+/*
+ * Fork handlers
+ */
+static void fork_prepare(void);
+static void fork_parent(void);
+static void fork_child(void);
+
+/*
+ * Admission control
+ */
+
+/* Add to the usage of a resource if it stays within the hard limit */
+static bool limit_acquire(routines_limit_t limit, size_t amount);
+
+/* Remove from the usage of a resource */
+static void limit_release(routines_limit_t limit, size_t amount);
+
+/* Call the overload handler if usage has just passed a soft limit */
+static void limit_overload(
+	routines_limit_t limit,
+	size_t usage,
+	size_t amount
+);
+
+/*
+ * Object allocation
+ */
+static void *object_alloc(object_slab_t *slab);
+static void object_free(object_slab_t *slab, void *object);
+
+/*
+ * Allocate memory for an I/O buffer
+ *
+ * Buffers in static builds are taken from a shared arena and are never
+ * given back to it.
+ */
+static void *buffer_alloc(size_t size);
+#ifndef ROUTINES_STATIC
+static void buffer_free(void *buffer);
+#endif
+
 /*
  * Stack allocation
  */
-static unsigned char *alloc_stack(void);
+/*
+ * Allocate a stack, returning the base of the stack
+ *
+ * Returns EAGAIN if the stack limit has been reached or ENOMEM if no
+ * stack could be mapped.
+ */
+static int alloc_stack(unsigned char **stack_base);
 static void free_stack(unsigned char *stack_base);
 static void push_stack(unsigned char *stack_base);
 static unsigned char *pop_stack(void);
 
+/*
+ * Release unused stacks of the calling thread beyond the first `keep`,
+ * returning the number released
+ */
+static size_t trim_stacks(size_t keep);
+
+#ifndef ROUTINES_STATIC
+/*
+ * Map a chunk of stacks to be taken by later allocations
+ *
+ * Falls back to a single stack near the stack limit or if the chunk
+ * could not be mapped. Returns EAGAIN if the stack limit has been
+ * reached or ENOMEM if no stack could be mapped.
+ */
+static int reserve_stacks(void);
+
+/* Unmap the lowest reserved stacks, keeping the first `keep` */
+static size_t release_reserved(size_t keep);
+#endif
+
 /*
  * Communication primitives
  */
 
-/* Primitive send operation */
-static void send(
+/*
+ * Primitive send operation
+ *
+ * A message for a co-routine that is already waiting is handed straight
+ * to it, and the co-routine is switched to, without queueing. Returns
+ * ENOMEM, without blocking, if the message could not be queued.
+ */
+static int queue_send(
 	routines_queue_t *send_queue,
 	void *message,
 	routines_coroutine_t *sender,
@@ -160,84 +943,344 @@ static void send(
 );
 
 /* Primitive recv operation */
-static void *recv(
+static void *queue_recv(
 	routines_queue_t *recv_queue,
 	routines_queue_t **reply_queue
 );
 
+/* Hand a message to a co-routine waiting to receive */
+static void handoff(
+	routines_coroutine_t *server,
+	void *message,
+	routines_queue_t *reply_queue
+);
+
 /*
- * Co-routine management
+ * Wait to receive a message on an empty queue, switching to the given
+ * co-routine or the next ready co-routine if NULL
  */
+static void *recv_blocked(
+	routines_queue_t *recv_queue,
+	routines_queue_t **reply_queue,
+	routines_coroutine_t *coroutine
+);
 
 /*
- * Transfer execution to another coroutine
+ * Event sources
+ */
+
+/*
+ * Create a source reading events from a non-blocking file descriptor
  *
- * If coroutine is NULL, to the next ready co-routine or to the initial
- * process thread if none is available. The current coroutine is enqueud
- * in the passed queue, if any.
+ * The file descriptor is closed on failure.
  */
-static void transfer(
-	coroutine_queue_t *queue,
-	routines_state_t state,
-	routines_coroutine_t *coroutine
+static routines_source_t *source_create(
+	int kind,
+	int fd,
+	routines_queue_t *queue
 );
 
-/* Call a function on a new stack. */
-static inline void call_on_stack(
-	void (*callback)(routines_coroutine_t *),
-	routines_coroutine_t *coroutine
-);
+/* Body of the co-routine reading a source */
+static void source_run(void *arg);
 
-/* Entryoupint for a new co-routine */
-static void routine_entry(routines_coroutine_t *coroutine);
+/*
+ * Read the next event from a source
+ *
+ * Returns 0 on success, EAGAIN if there is no event yet or another
+ * errno value if the source can produce no more events.
+ */
+static int source_read(routines_source_t *source, void **message);
 
 /*
- * External interface
+ * Worker pools
  */
 
-routines_coroutine_t *routines_spawn(routines_task_t task, void *arg) {
-	assert(task != NULL);
+/*
+ * Spawn a new worker for a pool
+ *
+ * Returns false if the worker could not be spawned.
+ */
+static bool pool_spawn(routines_pool_t *pool);
 
-	routines_coroutine_t *coroutine = malloc(sizeof(*coroutine));
-	*coroutine = (routines_coroutine_t) {
-		.entrypoint = task,
-		.arg = arg,
-		.stack_base = alloc_stack(),
-		.next = NULL,
-		.prev = NULL,
-	};
+/* Body of a worker co-routine */
+static void pool_worker(void *arg);
 
-	routines_coroutine_t *self = current_coroutine;
+/* Destroy any workers that have retired */
+static void pool_reap(routines_pool_t *pool);
 
-	int jmp_result;
-	if (self != NULL) {
-		coroutine_enqueue(&ready_queue, self);
-		jmp_result = setjmp(self->context);
-	} else {
-		jmp_result = setjmp(root_task.context);
-	}
+/* Add a worker to the front of a worker list */
+static void pool_worker_push(
+	pool_worker_t **list,
+	pool_worker_t *worker
+);
 
-    if (!jmp_result) {
-		call_on_stack(routine_entry, coroutine);
-	}
+/* Remove a worker from a worker list */
+static void pool_worker_remove(
+	pool_worker_t **list,
+	pool_worker_t *worker
+);
 
-	if (exited_coroutine != NULL) {
-		free_stack(exited_coroutine->stack_base);
-		exited_coroutine->stack_base = NULL;
-		exited_coroutine = NULL;
-	}
+/*
+ * Helper threads
+ */
 
-	return coroutine;
+/* Start the helper threads if they are not yet running */
+static size_t helpers_start(helper_pool_t *pool);
+
+/* Forget the helper threads, which don't exist in the child of a fork */
+static void helpers_reset(helper_pool_t *pool);
+
+/* Body of a helper thread */
+static void *helper_thread(void *pool);
+
+/* Queue a job to be run by a helper thread */
+static void helper_submit(helper_pool_t *pool, helper_job_t *job);
+
+/*
+ * Wait for a job to be done
+ *
+ * A job that is yet to be taken by a helper thread is cancelled.
+ */
+static void helper_finish(helper_pool_t *pool, helper_job_t *job);
+
+/*
+ * Run a file operation, on an I/O thread unless called from the initial
+ * task or no I/O threads are available
+ */
+static ssize_t file_io(file_request_t *request);
+
+/* Run a file operation and report it to the scheduler of its co-routine */
+static void file_run(void *request);
+
+/* Report a completed request to the scheduler of its co-routine */
+static void file_complete(file_request_t *request);
+
+/* Make co-routines whose file operations have completed ready */
+static void accept_completed(void);
+
+/*
+ * Get the log of the calling thread, creating it for the first record
+ *
+ * Returns NULL if memory could not be allocated.
+ */
+static log_t *log_self(void);
+
+/* Make the writer of a log run if a batch is due or it is idle */
+static void log_wake(log_t *log);
+
+/*
+ * Wait for a log buffer to be written
+ *
+ * The initial task runs other co-routines until it has been written.
+ */
+static void log_wait(log_t *log);
+
+/* Hand the records of the active buffer over to be written */
+static void log_swap(log_t *log);
+
+/* Write the records handed over from the other buffer */
+static void log_write(log_t *log);
+
+/* Body of the co-routine writing log records in batches */
+static void log_writer(void *arg);
+
+/*
+ * Write remaining log records of the exiting thread
+ *
+ * Records are written directly as the thread may exit from any
+ * co-routine.
+ */
+static void log_exit(void);
+
+/* Free the log of the exiting thread and destroy its writer */
+static void log_release(void);
+
+/* Write remaining log records when the process exits */
+static void log_register_exit(void);
+
+/* Run chunks of a parallel loop until none remain */
+static void parallel_run(void *arg);
+
+/*
+ * Run chunks of a parallel loop on a helper thread, waking the caller
+ * if this is the last job to finish
+ */
+static void parallel_job(void *arg);
+
+/* Get the number of helper threads to use for a parallel loop */
+static size_t parallel_jobs(parallel_t *loop);
+
+/*
+ * Run a parallel loop on the calling thread and helper threads
+ *
+ * A co-routine leaves the loop to the helper threads and waits for them
+ * as for a file operation, so that other co-routines keep running. The
+ * initial task shares the loop and blocks its thread.
+ */
+static void parallel(parallel_t *loop, size_t jobs);
+
+/*
+ * Co-routine management
+ */
+
+/*
+ * Transfer execution to another coroutine
+ *
+ * If coroutine is NULL, to the next ready co-routine or to the initial
+ * process thread if none is available. The current coroutine is enqueud
+ * in the passed queue, if any.
+ */
+static void transfer(
+	coroutine_queue_t *queue,
+	routines_state_t state,
+	routines_coroutine_t *coroutine
+);
+
+/*
+ * Finish a context switch on the thread that the co-routine resumed on
+ *
+ * Frees the stack of a co-routine that exited to make the switch, or the
+ * whole co-routine if it was detached.
+ */
+static void switched(void) __attribute__((noinline));
+
+/* Make a co-routine blocked on a join ready on the thread that owns it */
+static void join_wake(routines_coroutine_t *coroutine);
+
+/* Call a function on a new stack. */
+static inline void call_on_stack(
+	void (*callback)(routines_coroutine_t *),
+	routines_coroutine_t *coroutine
+);
+
+/*
+ * Spawn a co-routine running either a task or a function
+ *
+ * Returns 0 on success, EAGAIN if a limit has been reached, or ENOMEM.
+ */
+static int spawn(
+	routines_coroutine_t **spawned,
+	routines_task_t task,
+	routines_function_t function,
+	void *arg
+);
+
+/* Entryoupint for a new co-routine */
+static void routine_entry(routines_coroutine_t *coroutine);
+
+/*
+ * External interface
+ */
+
+routines_coroutine_t *routines_spawn(routines_task_t task, void *arg) {
+	routines_coroutine_t *coroutine = NULL;
+	routines_spawn_ex(&coroutine, task, arg);
+	return coroutine;
+}
+
+int routines_spawn_ex(
+	routines_coroutine_t **spawned,
+	routines_task_t task,
+	void *arg
+) {
+	assert(spawned != NULL);
+	assert(task != NULL);
+
+	return spawn(spawned, task, NULL, arg);
+}
+
+routines_coroutine_t *routines_spawn_function(
+	routines_function_t function,
+	void *arg
+) {
+	routines_coroutine_t *coroutine = NULL;
+	routines_spawn_function_ex(&coroutine, function, arg);
+	return coroutine;
+}
+
+int routines_spawn_function_ex(
+	routines_coroutine_t **spawned,
+	routines_function_t function,
+	void *arg
+) {
+	assert(spawned != NULL);
+	assert(function != NULL);
+
+	return spawn(spawned, NULL, function, arg);
+}
+
+static int spawn(
+	routines_coroutine_t **spawned,
+	routines_task_t task,
+	routines_function_t function,
+	void *arg
+) {
+	if (!limit_acquire(ROUTINES_LIMIT_COROUTINES, 1)) {
+		return EAGAIN;
+	}
+
+	routines_scheduler_t *scheduler = scheduler_self();
+	if (scheduler == NULL) {
+		limit_release(ROUTINES_LIMIT_COROUTINES, 1);
+		return ENOMEM;
+	}
+
+	unsigned char *stack_base;
+	int error = alloc_stack(&stack_base);
+	if (error != 0) {
+		limit_release(ROUTINES_LIMIT_COROUTINES, 1);
+		return error;
+	}
+
+	routines_coroutine_t *coroutine = object_alloc(&coroutine_slab);
+	if (coroutine == NULL) {
+		free_stack(stack_base);
+		limit_release(ROUTINES_LIMIT_COROUTINES, 1);
+		return ENOMEM;
+	}
+
+	*coroutine = (routines_coroutine_t) {
+		.entrypoint = task,
+		.function = function,
+		.arg = arg,
+		.stack_base = stack_base,
+		.wait_fd = -1,
+		.scheduler = scheduler,
+		.next = NULL,
+		.prev = NULL,
+	};
+	atomic_fetch_add(&coroutine->scheduler->load, 1);
+	scheduler_hold(coroutine->scheduler);
+	*spawned = coroutine;
+
+	routines_coroutine_t *self = current_coroutine;
+
+	int jmp_result;
+	if (self != NULL) {
+		coroutine_enqueue(&ready_queue, self);
+		jmp_result = setjmp(self->context);
+	} else {
+		jmp_result = setjmp(root_task.context);
+	}
+
+    if (!jmp_result) {
+		call_on_stack(routine_entry, coroutine);
+	}
+
+	switched();
+
+	return 0;
 }
 
 void routines_destroy(routines_coroutine_t *coroutine) {
 	assert(coroutine != NULL);
+	assert(!coroutine->file_io);
 
 	routines_suspend(coroutine);
 	coroutine_queue_t *join_queue = &coroutine->join_queue;
 	routines_coroutine_t *joined = coroutine_dequeue(join_queue);
 	while (joined != NULL) {
-		routines_resume(joined);
+		join_wake(joined);
 		joined = coroutine_dequeue(join_queue);
 	}
 
@@ -245,7 +1288,22 @@ void routines_destroy(routines_coroutine_t *coroutine) {
 		free_stack(coroutine->stack_base);
 	}
 
-	free(coroutine);
+	atomic_fetch_sub(&coroutine->scheduler->load, 1);
+	scheduler_drop(coroutine->scheduler);
+	limit_release(ROUTINES_LIMIT_COROUTINES, 1);
+
+	object_free(&coroutine_slab, coroutine);
+}
+
+void routines_detach(routines_coroutine_t *coroutine) {
+	assert(coroutine != NULL);
+	assert(!coroutine->detached);
+
+	if (coroutine->state == ROUTINES_COMPLETED) {
+		routines_destroy(coroutine);
+	} else {
+		coroutine->detached = true;
+	}
 }
 
 routines_coroutine_t *routines_self(void) {
@@ -276,11 +1334,34 @@ void routines_yield(void) {
 	transfer(&ready_queue, ROUTINES_RUNNING, NULL);
 }
 
-void routines_join(routines_coroutine_t *coroutine) {
-	assert(current_coroutine != NULL);
+void *routines_join(routines_coroutine_t *coroutine) {
 	assert(coroutine != NULL);
 
+	if (coroutine->state == ROUTINES_COMPLETED) {
+		return coroutine->result;
+	}
+
+	assert(current_coroutine != NULL);
+
+	/* The result is handed over as the joined co-routine may be destroyed */
+	routines_coroutine_t *self = current_coroutine;
+	self->join_result = NULL;
 	transfer(&coroutine->join_queue, ROUTINES_BLOCKED_JOIN, NULL);
+
+	return self->join_result;
+}
+
+int routines_try_join(routines_coroutine_t *coroutine, void **result) {
+	assert(coroutine != NULL);
+
+	if (coroutine->state != ROUTINES_COMPLETED) {
+		return EAGAIN;
+	}
+
+	if (result != NULL) {
+		*result = coroutine->result;
+	}
+	return 0;
 }
 
 void routines_suspend(routines_coroutine_t *coroutine) {
@@ -292,6 +1373,12 @@ void routines_suspend(routines_coroutine_t *coroutine) {
 		coroutine->message = NULL;
 	}
 
+	if (coroutine->state == ROUTINES_BLOCKED_IO && coroutine->wait_fd >= 0) {
+		/* Stop waiting so that a later event can't wake it */
+		epoll_ctl(reactor.poll_fd, EPOLL_CTL_DEL, coroutine->wait_fd, NULL);
+		coroutine->wait_fd = -1;
+	}
+
 	if (coroutine->queue != NULL) {
 		/* remove from any other queues */
 		coroutine_remove(coroutine);
@@ -316,306 +1403,3376 @@ void routines_resume(routines_coroutine_t *coroutine) {
 	coroutine_enqueue(&ready_queue, coroutine);
 }
 
-routines_queue_t *routines_queue_create(void) {
-	routines_queue_t *queue = malloc(sizeof(routines_queue_t));
-	*queue = (routines_queue_t) {
-		.head = NULL,
-		.tail = &queue->head,
-		.recv_queue = (coroutine_queue_t) {
-			.head = NULL,
-			.tail = NULL,
-		},
-	};
-	return queue;
+uint64_t routines_clock(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
 }
 
-void routines_queue_destroy(routines_queue_t *queue) {
-	assert(queue != NULL);
+void routines_sleep_until(uint64_t deadline) {
+	assert(current_coroutine != NULL);
 
-	while (pending_messages(queue)) {
-		dequeue_message(queue, NULL);
-	}
+	current_coroutine->deadline = deadline;
+	sleep_enqueue(current_coroutine);
+	transfer(NULL, ROUTINES_BLOCKED_SLEEP, NULL);
+}
 
-	routines_coroutine_t *server
-		= coroutine_dequeue(&queue->recv_queue);
-	while (server != NULL) {
-		routines_resume(server);
-		server = coroutine_dequeue(&queue->recv_queue);
+bool routines_next_deadline(uint64_t *deadline) {
+	assert(deadline != NULL);
+
+	if (sleep_queue.head == NULL) {
+		return false;
 	}
 
-	free(queue);
+	*deadline = sleep_queue.head->deadline;
+	return true;
 }
 
-void routines_send(routines_queue_t *queue, void *message) {
+int routines_wait_fd(int fd, uint32_t events, uint32_t *revents) {
 	assert(current_coroutine != NULL);
-	assert(queue != NULL);
 
-	send(queue, message, current_coroutine, NULL);
+	int error = reactor_start();
+	if (error != 0) {
+		return error;
+	}
+
+	routines_coroutine_t *self = current_coroutine;
+
+	/* A disarmed registration is left behind by each wait to reuse */
+	struct epoll_event event = {
+		.events = events | EPOLLONESHOT,
+		.data.ptr = self,
+	};
+	if (epoll_ctl(reactor.poll_fd, EPOLL_CTL_MOD, fd, &event) != 0) {
+		if (
+			errno != ENOENT
+			|| epoll_ctl(reactor.poll_fd, EPOLL_CTL_ADD, fd, &event) != 0
+		) {
+			return errno;
+		}
+	}
+
+	self->wait_fd = fd;
+	self->revents = 0;
+	transfer(&io_queue, ROUTINES_BLOCKED_IO, NULL);
+
+	if (revents != NULL) {
+		*revents = self->revents;
+	}
+	return 0;
 }
 
-void *routines_wait(routines_queue_t *queue) {
-	assert(current_coroutine != NULL);
-	assert(queue != NULL);
+bool routines_poll(void) {
+	assert(current_coroutine == NULL);
+
+	/* Migrations are signalled through the reactor once it starts */
+	reactor_start();
+	accept_migrated();
+	accept_completed();
+	wake_sleepers();
+
+	if (ready_queue.head == NULL) {
+		if (
+			sleep_queue.head == NULL
+			&& io_queue.head == NULL
+			&& file_pending == 0
+		) {
+			return false;
+		}
+
+		int timeout = -1;
+		if (sleep_queue.head != NULL) {
+			uint64_t now = routines_clock();
+			uint64_t deadline = sleep_queue.head->deadline;
+			uint64_t wait = deadline > now ? deadline - now : 0;
+
+			/* Round up so that sleepers never wake early */
+			wait = (wait + 999999) / 1000000;
+			timeout = wait > INT32_MAX ? INT32_MAX : (int)wait;
+		}
+
+		reactor_wait(timeout);
+	}
+
+	routines_yield();
+	return true;
+}
+
+int routines_recv_datagrams(
+	int fd,
+	struct mmsghdr *msgs,
+	unsigned int max
+) {
+	assert(msgs != NULL || max == 0);
+
+	while (true) {
+		int count = recvmmsg(fd, msgs, max, MSG_DONTWAIT, NULL);
+		if (count >= 0) {
+			return count;
+		}
+		if (errno == EINTR) {
+			continue;
+		}
+		if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			return -1;
+		}
+
+		int error = fd_wait(fd, EPOLLIN);
+		if (error != 0) {
+			errno = error;
+			return -1;
+		}
+	}
+}
+
+int routines_send_datagrams(
+	int fd,
+	struct mmsghdr *msgs,
+	unsigned int count
+) {
+	assert(msgs != NULL || count == 0);
+
+	unsigned int sent = 0;
+
+	while (sent < count) {
+		int batch = sendmmsg(fd, msgs + sent, count - sent, MSG_DONTWAIT);
+		if (batch > 0) {
+			sent += batch;
+			continue;
+		}
+		if (batch < 0 && errno == EINTR) {
+			continue;
+		}
+		if (batch < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+			return sent > 0 ? (int)sent : -1;
+		}
+
+		int error = fd_wait(fd, EPOLLOUT);
+		if (error != 0) {
+			errno = error;
+			return sent > 0 ? (int)sent : -1;
+		}
+	}
+
+	return sent;
+}
+
+ssize_t routines_send_segments(
+	int fd,
+	const void *buf,
+	size_t len,
+	size_t segment,
+	const struct sockaddr *addr,
+	socklen_t addrlen
+) {
+	assert(buf != NULL || len == 0);
+	assert(segment > 0);
 
-	return recv(queue, NULL);
+	const unsigned char *bytes = buf;
+
+#ifdef UDP_SEGMENT
+	/* The kernel takes at most 64 segments in one datagram of 64KiB */
+	size_t chunk = (DATAGRAM_GSO_BYTES / segment) * segment;
+	if (chunk > DATAGRAM_BATCH * segment) {
+		chunk = DATAGRAM_BATCH * segment;
+	}
+
+	size_t sent = 0;
+	while (chunk > 0 && sent < len) {
+		size_t bytes_left = len - sent;
+		struct iovec iov = {
+			.iov_base = (void *)(bytes + sent),
+			.iov_len = bytes_left < chunk ? bytes_left : chunk,
+		};
+
+		union {
+			char buf[CMSG_SPACE(sizeof(uint16_t))];
+			struct cmsghdr align;
+		} control;
+		struct msghdr msg = {
+			.msg_name = (void *)addr,
+			.msg_namelen = addrlen,
+			.msg_iov = &iov,
+			.msg_iovlen = 1,
+			.msg_control = control.buf,
+			.msg_controllen = sizeof(control.buf),
+		};
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_UDP;
+		cmsg->cmsg_type = UDP_SEGMENT;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+		uint16_t size = segment;
+		memcpy(CMSG_DATA(cmsg), &size, sizeof(size));
+
+		ssize_t result = sendmsg(fd, &msg, MSG_DONTWAIT);
+		if (result >= 0) {
+			sent += result;
+			continue;
+		}
+		if (errno == EINTR) {
+			continue;
+		}
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			int error = fd_wait(fd, EPOLLOUT);
+			if (error != 0) {
+				errno = error;
+				return sent > 0 ? (ssize_t)sent : -1;
+			}
+			continue;
+		}
+
+		/*
+		 * Kernels or devices without segmentation offload reject the
+		 * option, so the rest is sent one datagram at a time
+		 */
+		if (
+			errno != EIO
+			&& errno != EINVAL
+			&& errno != ENOPROTOOPT
+			&& errno != EOPNOTSUPP
+		) {
+			return sent > 0 ? (ssize_t)sent : -1;
+		}
+		break;
+	}
+
+	if (sent == len) {
+		return sent;
+	}
+
+	ssize_t rest = send_segments_batched(
+		fd,
+		bytes + sent,
+		len - sent,
+		segment,
+		addr,
+		addrlen
+	);
+	if (rest < 0) {
+		return sent > 0 ? (ssize_t)sent : -1;
+	}
+	return sent + rest;
+#else
+	return send_segments_batched(fd, bytes, len, segment, addr, addrlen);
+#endif
 }
 
-void routines_signal(routines_queue_t *queue, void *message) {
+routines_source_t *routines_source_signal(
+	routines_queue_t *queue,
+	int signo
+) {
 	assert(queue != NULL);
 
-	send(queue, message, NULL, NULL);
+	/* Blocked signals stay pending until they are read */
+	sigset_t set;
+	sigemptyset(&set);
+	if (sigaddset(&set, signo) != 0) {
+		return NULL;
+	}
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	int fd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (fd < 0) {
+		return NULL;
+	}
+
+	return source_create(SOURCE_SIGNAL, fd, queue);
 }
 
-void *routines_read(routines_queue_t *queue) {
+routines_source_t *routines_source_timer(
+	routines_queue_t *queue,
+	uint64_t interval
+) {
 	assert(queue != NULL);
+	assert(interval > 0);
+
+	int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd < 0) {
+		return NULL;
+	}
+
+	struct timespec period = {
+		.tv_sec = interval / 1000000000,
+		.tv_nsec = interval % 1000000000,
+	};
+	struct itimerspec timer = {
+		.it_interval = period,
+		.it_value = period,
+	};
+	if (timerfd_settime(fd, 0, &timer, NULL) != 0) {
+		int error = errno;
+		close(fd);
+		errno = error;
+		return NULL;
+	}
+
+	return source_create(SOURCE_TIMER, fd, queue);
+}
+
+routines_source_t *routines_source_event(routines_queue_t *queue) {
+	assert(queue != NULL);
+
+	int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fd < 0) {
+		return NULL;
+	}
+
+	return source_create(SOURCE_EVENT, fd, queue);
+}
+
+routines_source_t *routines_source_child(
+	routines_queue_t *queue,
+	pid_t pid
+) {
+	assert(queue != NULL);
+
+#ifdef SYS_pidfd_open
+	int fd = syscall(SYS_pidfd_open, pid, 0);
+	if (fd < 0) {
+		return NULL;
+	}
+
+	/* The reader never blocks as it waits only once the child exits */
+	return source_create(SOURCE_CHILD, fd, queue);
+#else
+	errno = ENOSYS;
+	return NULL;
+#endif
+}
+
+int routines_source_fd(routines_source_t *source) {
+	assert(source != NULL);
+
+	return source->fd;
+}
+
+void routines_source_destroy(routines_source_t *source) {
+	assert(source != NULL);
+
+	routines_destroy(source->reader);
+	close(source->fd);
+	object_free(&source_slab, source);
+}
+
+ssize_t routines_pread(int fd, void *buf, size_t count, off_t offset) {
+	file_request_t request = {
+		.operation = FILE_PREAD,
+		.fd = fd,
+		.buf = buf,
+		.count = count,
+		.offset = offset,
+	};
+	return file_io(&request);
+}
+
+ssize_t routines_pwrite(
+	int fd,
+	const void *buf,
+	size_t count,
+	off_t offset
+) {
+	file_request_t request = {
+		.operation = FILE_PWRITE,
+		.fd = fd,
+		.buf = (void *)buf,
+		.count = count,
+		.offset = offset,
+	};
+	return file_io(&request);
+}
+
+int routines_fsync(int fd) {
+	file_request_t request = {
+		.operation = FILE_FSYNC,
+		.fd = fd,
+	};
+	return file_io(&request);
+}
+
+int routines_fdatasync(int fd) {
+	file_request_t request = {
+		.operation = FILE_FDATASYNC,
+		.fd = fd,
+	};
+	return file_io(&request);
+}
+
+void *routines_io_buffer_alloc(size_t size) {
+	size_t page = sysconf(_SC_PAGESIZE);
+	size = (size + page - 1) / page * page;
+
+	void *buffer = NULL;
+	int error = posix_memalign(&buffer, page, size);
+	if (error != 0) {
+		errno = error;
+		return NULL;
+	}
+
+	return buffer;
+}
+
+void routines_io_buffer_free(void *buffer) {
+	free(buffer);
+}
+
+void routines_log_config(int fd, size_t batch, uint64_t interval) {
+	assert(fd >= 0);
+
+	if (batch > ROUTINES_LOG_BYTES) {
+		batch = ROUTINES_LOG_BYTES;
+	}
+
+	atomic_store(&log_config.fd, fd);
+	atomic_store(&log_config.batch, batch);
+	atomic_store(&log_config.interval, interval);
+}
+
+void routines_log(const char *format, ...) {
+	va_list args;
+	va_start(args, format);
+	routines_vlog(format, args);
+	va_end(args);
+}
+
+void routines_vlog(const char *format, va_list args) {
+	assert(format != NULL);
+
+	log_t *log = log_self();
+	if (log == NULL) {
+		vdprintf(atomic_load(&log_config.fd), format, args);
+		return;
+	}
+
+	while (true) {
+		size_t space = ROUTINES_LOG_BYTES - log->used;
+		char *end = log->buffers[log->active] + log->used;
+
+		va_list copy;
+		va_copy(copy, args);
+		int length = vsnprintf(end, space, format, copy);
+		va_end(copy);
+
+		if (length < 0) {
+			return;
+		}
+
+		if ((size_t)length < space || log->used == 0) {
+			if (log->used == 0) {
+				log->first = routines_clock();
+			}
+
+			/* A record longer than a whole buffer is truncated */
+			if ((size_t)length >= space) {
+				length = space - 1;
+			}
+			log->used += length;
+			break;
+		}
+
+		/* Make space by handing the active buffer to the writer */
+		if (log->pending > 0) {
+			log_wait(log);
+		} else {
+			log_swap(log);
+			log_wake(log);
+		}
+	}
+
+	log_wake(log);
+}
+
+void routines_log_flush(void) {
+	log_t *log = thread_log;
+	if (log == NULL) {
+		return;
+	}
+
+	while (log->pending > 0 || log->used > 0) {
+		if (log->pending == 0) {
+			log_swap(log);
+		}
+		if (log->writing) {
+			log_wait(log);
+		} else {
+			log_write(log);
+		}
+	}
+}
+
+size_t routines_trim(size_t keep) {
+	size_t trimmed = trim_stacks(keep);
+
+#ifdef __GLIBC__
+	/* Freed control blocks and messages go back to the system */
+	malloc_trim(0);
+#endif
+
+	return trimmed;
+}
+
+size_t routines_unused_stacks(void) {
+	size_t count = 0;
+	for (unused_stack_t *stack = unused_stacks; stack != NULL; stack = stack->next) {
+		count += 1;
+	}
+#ifndef ROUTINES_STATIC
+	count += reserved_count;
+#endif
+	return count;
+}
+
+int routines_pressure_watch(
+	const char *path,
+	uint64_t stall,
+	uint64_t window
+) {
+	assert(stall > 0);
+	assert(window >= stall);
+
+	if (path == NULL) {
+		path = "/proc/pressure/memory";
+	}
+
+	int error = reactor_start();
+	if (error != 0) {
+		return error;
+	}
+
+	int fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0) {
+		return errno;
+	}
+
+	/* PSI triggers are given in microseconds */
+	char trigger[64];
+	int length = snprintf(
+		trigger,
+		sizeof(trigger),
+		"some %llu %llu",
+		(unsigned long long)(stall / 1000),
+		(unsigned long long)(window / 1000)
+	);
+
+	struct epoll_event event = {
+		.events = EPOLLPRI,
+		.data.ptr = &reactor,
+	};
+	if (
+		write(fd, trigger, length + 1) < 0
+		|| epoll_ctl(reactor.poll_fd, EPOLL_CTL_ADD, fd, &event) != 0
+	) {
+		error = errno;
+		close(fd);
+		return error;
+	}
+
+	routines_pressure_unwatch();
+	reactor.pressure_fd = fd;
+
+	return 0;
+}
+
+void routines_pressure_unwatch(void) {
+	if (reactor.pressure_fd >= 0) {
+		close(reactor.pressure_fd);
+		reactor.pressure_fd = -1;
+	}
+}
+
+void routines_limit_set(routines_limit_t limit, size_t soft, size_t hard) {
+	assert(limit < ROUTINES_LIMITS);
+	assert(hard == 0 || soft <= hard);
+
+	atomic_store_explicit(&limits.soft[limit], soft, memory_order_relaxed);
+	atomic_store_explicit(&limits.hard[limit], hard, memory_order_relaxed);
+}
+
+size_t routines_limit_usage(routines_limit_t limit) {
+	assert(limit < ROUTINES_LIMITS);
+
+	return atomic_load(&limits.usage[limit]);
+}
+
+void routines_overload_set(routines_overload_t handler, void *ctx) {
+	pthread_mutex_lock(&limits.lock);
+	limits.handler = handler;
+	limits.ctx = ctx;
+	pthread_mutex_unlock(&limits.lock);
+}
+
+routines_scheduler_t *routines_scheduler(void) {
+	return scheduler_self();
+}
+
+size_t routines_scheduler_load(routines_scheduler_t *scheduler) {
+	assert(scheduler != NULL);
+
+	return atomic_load(&scheduler->load);
+}
+
+void routines_migrate(
+	routines_coroutine_t *coroutine,
+	routines_scheduler_t *scheduler
+) {
+	assert(coroutine != NULL);
+	assert(scheduler != NULL);
+	assert(coroutine != current_coroutine);
+	assert(coroutine->scheduler == this_scheduler);
+	assert(!coroutine->file_io);
+	assert(
+		coroutine->state == ROUTINES_SUSPENDED
+		|| coroutine->queue == &ready_queue
+	);
+
+	if (scheduler == coroutine->scheduler) {
+		return;
+	}
+
+	if (coroutine->queue != NULL) {
+		coroutine_remove(coroutine);
+	}
+
+	atomic_fetch_add(&scheduler->load, 1);
+	scheduler_hold(scheduler);
+	atomic_fetch_sub(&coroutine->scheduler->load, 1);
+	scheduler_drop(coroutine->scheduler);
+	coroutine->scheduler = scheduler;
+
+	scheduler_enqueue(scheduler, coroutine);
+}
+
+size_t routines_rebalance(void) {
+	routines_scheduler_t *self = scheduler_self();
+	if (self == NULL) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&schedulers.lock);
+
+	routines_scheduler_t *target = NULL;
+	for (
+		routines_scheduler_t *other = schedulers.head;
+		other != NULL;
+		other = other->next
+	) {
+		if (
+			other != self
+			&& (
+				target == NULL
+				|| atomic_load(&other->load) < atomic_load(&target->load)
+			)
+		) {
+			target = other;
+		}
+	}
+
+	/* Move the most recently readied co-routines first */
+	size_t migrated = 0;
+	while (
+		target != NULL
+		&& ready_queue.tail != NULL
+		&& atomic_load(&self->load) > atomic_load(&target->load) + 1
+	) {
+		routines_migrate(ready_queue.tail, target);
+		migrated += 1;
+	}
+
+	pthread_mutex_unlock(&schedulers.lock);
+
+	return migrated;
+}
+
+void routines_fork_child(bool keep_stacks) {
+	suspend_all(&ready_queue);
+	suspend_all(&sleep_queue);
+	suspend_all(&io_queue);
+
+	/* The epoll instance is shared with the parent */
+	reactor_stop();
+
+	/* Only the forking thread exists in the child */
+	schedulers.head = NULL;
+	if (this_scheduler != NULL) {
+		routines_scheduler_t *self = this_scheduler;
+		pthread_mutex_init(&self->lock, NULL);
+		suspend_all(&self->incoming);
+		atomic_store(&self->migrated, false);
+		self->next = NULL;
+		schedulers.head = self;
+	}
+
+	/* Only the forking thread exists in the child */
+	helpers_reset(&helpers);
+	helpers_reset(&io_helpers);
+
+	/* File operations in flight are never completed in the child */
+	file_pending = 0;
+	if (this_scheduler != NULL) {
+		this_scheduler->completed = NULL;
+		atomic_store(&this_scheduler->completions, false);
+	}
+
+	/* Records not yet written are written by the parent */
+	if (thread_log != NULL) {
+		log_t *log = thread_log;
+		if (log->writing) {
+			/* The writer waits for a write that never completes */
+			log->writer = NULL;
+			log->writing = false;
+		}
+		suspend_all(&log->waiting);
+		log->pending = 0;
+		log->used = 0;
+	}
+
+	if (!keep_stacks) {
+#ifndef ROUTINES_STATIC
+		unsigned char *stack_base = pop_stack();
+		while (stack_base != NULL) {
+			munmap(stack_base - STACK_SIZE, STACK_SIZE);
+			limit_release(ROUTINES_LIMIT_STACK_BYTES, STACK_SIZE);
+			stack_base = pop_stack();
+		}
+		release_reserved(0);
+#endif
+	}
+}
+
+void routines_atfork(bool keep_stacks) {
+	fork_keep_stacks = keep_stacks;
+
+	if (!fork_registered) {
+		pthread_atfork(fork_prepare, fork_parent, fork_child);
+		fork_registered = true;
+	}
+}
+
+routines_checkpoint_t *routines_checkpoint_create(void) {
+	routines_checkpoint_t *checkpoint = malloc(sizeof(*checkpoint));
+	if (checkpoint == NULL) {
+		return NULL;
+	}
+
+	*checkpoint = (routines_checkpoint_t) {
+		.coroutines = NULL,
+		.sizes = NULL,
+		.count = 0,
+		.capacity = 0,
+		.mapping = NULL,
+		.mapping_size = 0,
+	};
+	return checkpoint;
+}
+
+int routines_checkpoint_add(
+	routines_checkpoint_t *checkpoint,
+	routines_coroutine_t *coroutine,
+	size_t size
+) {
+	assert(checkpoint != NULL);
+	assert(checkpoint->mapping == NULL);
+	assert(coroutine != NULL);
+	assert(coroutine->state == ROUTINES_SUSPENDED);
+	assert(coroutine->entrypoint != NULL);
+	assert(size == 0 || coroutine->arg != NULL);
+
+	if (checkpoint->count == checkpoint->capacity) {
+		size_t capacity = checkpoint->capacity * 2 + 8;
+
+		/* Each array is kept valid if the other can't grow */
+		routines_coroutine_t **coroutines = realloc(
+			checkpoint->coroutines,
+			capacity * sizeof(routines_coroutine_t *)
+		);
+		if (coroutines == NULL) {
+			return ENOMEM;
+		}
+		checkpoint->coroutines = coroutines;
+
+		size_t *sizes = realloc(
+			checkpoint->sizes,
+			capacity * sizeof(size_t)
+		);
+		if (sizes == NULL) {
+			return ENOMEM;
+		}
+		checkpoint->sizes = sizes;
+
+		checkpoint->capacity = capacity;
+	}
+
+	checkpoint->coroutines[checkpoint->count] = coroutine;
+	checkpoint->sizes[checkpoint->count] = size;
+	checkpoint->count += 1;
+
+	return 0;
+}
+
+int routines_checkpoint_save(
+	routines_checkpoint_t *checkpoint,
+	const char *path
+) {
+	assert(checkpoint != NULL);
+	assert(path != NULL);
+
+	size_t size = CHECKPOINT_ALIGN(sizeof(checkpoint_header_t));
+	for (size_t c = 0; c < checkpoint->count; c += 1) {
+		size += CHECKPOINT_ALIGN(sizeof(checkpoint_record_t));
+		size += CHECKPOINT_ALIGN(checkpoint->sizes[c]);
+	}
+
+	/* Write to a temporary file to replace the checkpoint atomically */
+	char temporary[4096];
+	int length = snprintf(temporary, sizeof(temporary), "%s.tmp", path);
+	if (length < 0 || (size_t)length >= sizeof(temporary)) {
+		return ENAMETOOLONG;
+	}
+
+	int fd = open(temporary, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		return errno;
+	}
+
+	int error = 0;
+	unsigned char *mapping = MAP_FAILED;
+	if (ftruncate(fd, size) < 0) {
+		error = errno;
+	} else {
+		mapping = mmap(NULL, size, PROT_WRITE, MAP_SHARED, fd, 0);
+		if (mapping == MAP_FAILED) {
+			error = errno;
+		}
+	}
+
+	if (mapping != MAP_FAILED) {
+		checkpoint_header_t *header = (checkpoint_header_t *)mapping;
+		memcpy(header->magic, CHECKPOINT_MAGIC, sizeof(header->magic));
+		header->version = CHECKPOINT_VERSION;
+		header->count = checkpoint->count;
+
+		unsigned char *next = mapping
+			+ CHECKPOINT_ALIGN(sizeof(checkpoint_header_t));
+		for (size_t c = 0; c < checkpoint->count && error == 0; c += 1) {
+			routines_coroutine_t *coroutine = checkpoint->coroutines[c];
+			checkpoint_record_t *record = (checkpoint_record_t *)next;
+
+			/* Tasks are saved relative to the object containing them */
+			Dl_info info;
+			if (
+				dladdr((void *)coroutine->entrypoint, &info) == 0
+				|| info.dli_fname == NULL
+				|| strlen(info.dli_fname) >= sizeof(record->object)
+			) {
+				error = ENOENT;
+				break;
+			}
+			/* The object must be the same build when restored */
+			object_search_t search = {
+				.path = info.dli_fname,
+				.base = 0,
+			};
+			if (dl_iterate_phdr(find_object, &search) == 0) {
+				error = ENOENT;
+				break;
+			}
+			record->identity_size = search.identity_size;
+			memcpy(record->identity, search.identity, search.identity_size);
+
+			strcpy(record->object, info.dli_fname);
+			record->task_offset = (uintptr_t)coroutine->entrypoint
+				- (uintptr_t)info.dli_fbase;
+			record->size = checkpoint->sizes[c];
+
+			next += CHECKPOINT_ALIGN(sizeof(checkpoint_record_t));
+			memcpy(next, coroutine->arg, record->size);
+			next += CHECKPOINT_ALIGN(record->size);
+		}
+
+		if (error == 0 && msync(mapping, size, MS_SYNC) < 0) {
+			error = errno;
+		}
+		munmap(mapping, size);
+	}
+
+	close(fd);
+
+	if (error == 0 && rename(temporary, path) < 0) {
+		error = errno;
+	}
+	if (error != 0) {
+		unlink(temporary);
+	}
+
+	return error;
+}
+
+routines_checkpoint_t *routines_checkpoint_restore(const char *path) {
+	assert(path != NULL);
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return NULL;
+	}
+
+	struct stat status;
+	if (fstat(fd, &status) < 0) {
+		close(fd);
+		return NULL;
+	}
+
+	size_t size = status.st_size;
+	if (size < sizeof(checkpoint_header_t)) {
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	unsigned char *mapping = mmap(
+		NULL,
+		size,
+		PROT_READ | PROT_WRITE,
+		MAP_PRIVATE,
+		fd, 0
+	);
+	close(fd);
+	if (mapping == MAP_FAILED) {
+		return NULL;
+	}
+
+	checkpoint_header_t *header = (checkpoint_header_t *)mapping;
+	if (
+		memcmp(header->magic, CHECKPOINT_MAGIC, sizeof(header->magic)) != 0
+		|| header->version != CHECKPOINT_VERSION
+	) {
+		munmap(mapping, size);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	/* Locate every task before starting any of them */
+	routines_task_t *tasks = malloc(header->count * sizeof(routines_task_t));
+	void **args = malloc(header->count * sizeof(void *));
+	if (header->count > 0 && (tasks == NULL || args == NULL)) {
+		free(tasks);
+		free(args);
+		munmap(mapping, size);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	unsigned char *next = mapping
+		+ CHECKPOINT_ALIGN(sizeof(checkpoint_header_t));
+	unsigned char *end = mapping + size;
+	for (size_t c = 0; c < header->count; c += 1) {
+		checkpoint_record_t *record = (checkpoint_record_t *)next;
+		next += CHECKPOINT_ALIGN(sizeof(checkpoint_record_t));
+
+		object_search_t search = {
+			.path = record->object,
+			.base = 0,
+		};
+		if (
+			next > end
+			|| record->size > (size_t)(end - next)
+			|| memchr(record->object, 0, sizeof(record->object)) == NULL
+			|| dl_iterate_phdr(find_object, &search) == 0
+		) {
+			free(tasks);
+			free(args);
+			munmap(mapping, size);
+			errno = EINVAL;
+			return NULL;
+		}
+
+		/* Offsets into a different build would start arbitrary code */
+		if (
+			record->identity_size != search.identity_size
+			|| memcmp(
+				record->identity,
+				search.identity,
+				search.identity_size
+			) != 0
+		) {
+			free(tasks);
+			free(args);
+			munmap(mapping, size);
+			errno = ENOEXEC;
+			return NULL;
+		}
+
+		tasks[c] = (routines_task_t)(search.base + record->task_offset);
+		args[c] = next;
+		next += CHECKPOINT_ALIGN(record->size);
+	}
+
+	routines_checkpoint_t *checkpoint = routines_checkpoint_create();
+	if (checkpoint == NULL) {
+		free(tasks);
+		free(args);
+		munmap(mapping, size);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	checkpoint->coroutines = malloc(
+		header->count * sizeof(routines_coroutine_t *)
+	);
+	checkpoint->sizes = malloc(header->count * sizeof(size_t));
+	checkpoint->capacity = header->count;
+	checkpoint->mapping = mapping;
+	checkpoint->mapping_size = size;
+
+	int error = 0;
+	if (
+		header->count > 0
+		&& (checkpoint->coroutines == NULL || checkpoint->sizes == NULL)
+	) {
+		error = ENOMEM;
+	}
+
+	for (size_t c = 0; error == 0 && c < header->count; c += 1) {
+		error = routines_spawn_ex(
+			&checkpoint->coroutines[c],
+			tasks[c],
+			args[c]
+		);
+		if (error == 0) {
+			checkpoint->sizes[c] = 0;
+			checkpoint->count += 1;
+		}
+	}
+
+	free(tasks);
+	free(args);
+
+	/* A partial restore is undone so that it can be retried */
+	if (error != 0) {
+		for (size_t c = 0; c < checkpoint->count; c += 1) {
+			routines_destroy(checkpoint->coroutines[c]);
+		}
+		routines_checkpoint_destroy(checkpoint);
+		errno = error;
+		return NULL;
+	}
+
+	return checkpoint;
+}
+
+size_t routines_checkpoint_count(routines_checkpoint_t *checkpoint) {
+	assert(checkpoint != NULL);
+
+	return checkpoint->count;
+}
+
+routines_coroutine_t *routines_checkpoint_coroutine(
+	routines_checkpoint_t *checkpoint,
+	size_t index
+) {
+	assert(checkpoint != NULL);
+	assert(index < checkpoint->count);
+
+	return checkpoint->coroutines[index];
+}
+
+void routines_checkpoint_destroy(routines_checkpoint_t *checkpoint) {
+	assert(checkpoint != NULL);
+
+	if (checkpoint->mapping != NULL) {
+		munmap(checkpoint->mapping, checkpoint->mapping_size);
+	}
+	free(checkpoint->coroutines);
+	free(checkpoint->sizes);
+	free(checkpoint);
+}
+
+routines_queue_t *routines_queue_create(void) {
+	routines_queue_t *queue = NULL;
+	routines_queue_create_ex(&queue);
+	return queue;
+}
+
+int routines_queue_create_ex(routines_queue_t **created) {
+	assert(created != NULL);
+
+	routines_queue_t *queue = object_alloc(&queue_slab);
+	if (queue == NULL) {
+		return ENOMEM;
+	}
+
+	*queue = (routines_queue_t) {
+		.head = NULL,
+		.tail = &queue->head,
+		.recv_queue = (coroutine_queue_t) {
+			.head = NULL,
+			.tail = NULL,
+		},
+	};
+	*created = queue;
+
+	return 0;
+}
+
+void routines_queue_destroy(routines_queue_t *queue) {
+	assert(queue != NULL);
+
+	while (pending_messages(queue)) {
+		dequeue_message(queue, NULL);
+	}
+
+	routines_coroutine_t *server
+		= coroutine_dequeue(&queue->recv_queue);
+	while (server != NULL) {
+		routines_resume(server);
+		server = coroutine_dequeue(&queue->recv_queue);
+	}
+
+	object_free(&queue_slab, queue);
+}
+
+int routines_send(routines_queue_t *queue, void *message) {
+	assert(current_coroutine != NULL);
+	assert(queue != NULL);
+
+	return queue_send(queue, message, current_coroutine, NULL);
+}
+
+int routines_try_send(routines_queue_t *queue, void *message) {
+	assert(queue != NULL);
+
+	routines_coroutine_t *server = coroutine_dequeue(&queue->recv_queue);
+	if (server == NULL) {
+		return EAGAIN;
+	}
+
+	/* The receiver takes the message when it next runs */
+	handoff(server, message, NULL);
+	server->state = ROUTINES_RUNNING;
+	coroutine_enqueue(&ready_queue, server);
+
+	return 0;
+}
+
+void *routines_wait(routines_queue_t *queue) {
+	assert(current_coroutine != NULL);
+	assert(queue != NULL);
+
+	return queue_recv(queue, NULL);
+}
+
+int routines_signal(routines_queue_t *queue, void *message) {
+	assert(queue != NULL);
+
+	return queue_send(queue, message, NULL, NULL);
+}
+
+void *routines_read(routines_queue_t *queue) {
+	assert(queue != NULL);
+
+	if (pending_messages(queue)) {
+		return queue_recv(queue, NULL);
+	} else {
+		return NULL;
+	}
+}
+
+void *routines_call(
+	routines_queue_t *send_queue,
+	void *message,
+	routines_queue_t *reply_queue
+) {
+	assert(current_coroutine != NULL);
+	assert(send_queue != NULL);
+	assert(reply_queue != NULL);
+
+	void *reply = NULL;
+	routines_call_ex(send_queue, message, reply_queue, &reply);
+	return reply;
+}
+
+int routines_call_ex(
+	routines_queue_t *send_queue,
+	void *message,
+	routines_queue_t *reply_queue,
+	void **reply
+) {
+	assert(current_coroutine != NULL);
+	assert(send_queue != NULL);
+	assert(reply_queue != NULL);
+	assert(reply != NULL);
+
+	routines_coroutine_t *self = current_coroutine;
+	self->handoff.calling = true;
+
+	/*
+	 * A waiting server is switched to directly while the caller waits on
+	 * the reply queue, so that a reply is handed straight back
+	 */
+	routines_coroutine_t *server = send_queue->recv_queue.head;
+	if (server != NULL && !pending_messages(reply_queue)) {
+		coroutine_remove(server);
+		handoff(server, message, reply_queue);
+		*reply = recv_blocked(reply_queue, NULL, server);
+		self->handoff.calling = false;
+		return 0;
+	}
+
+	int error = queue_send(send_queue, message, NULL, reply_queue);
+	if (error == 0) {
+		*reply = queue_recv(reply_queue, NULL);
+	}
+
+	self->handoff.calling = false;
+	return error;
+}
+
+int routines_try_call(
+	routines_queue_t *send_queue,
+	void *message,
+	routines_queue_t *reply_queue,
+	void **reply
+) {
+	assert(current_coroutine != NULL);
+	assert(send_queue != NULL);
+
+	if (send_queue->recv_queue.head == NULL) {
+		return EAGAIN;
+	}
+
+	return routines_call_ex(send_queue, message, reply_queue, reply);
+}
+
+void *routines_recv(
+	routines_queue_t *recv_queue,
+	routines_queue_t **reply_queue
+) {
+	assert(current_coroutine != NULL);
+	assert(recv_queue != NULL);
+
+	return queue_recv(recv_queue, reply_queue);
+}
+
+int routines_post(
+	routines_queue_t *send_queue,
+	void *message,
+	routines_queue_t *reply_queue
+) {
+	assert(current_coroutine != NULL);
+	assert(send_queue != NULL);
+
+	return queue_send(send_queue, message, NULL, reply_queue);
+}
+
+routines_pool_t *routines_pool_create(
+	routines_task_t task,
+	size_t min_workers,
+	size_t max_workers
+) {
+	assert(task != NULL);
+	assert(max_workers > 0);
+	assert(min_workers <= max_workers);
+
+	routines_pool_t *pool = object_alloc(&pool_slab);
+	if (pool == NULL) {
+		return NULL;
+	}
+
+	routines_queue_t *queue = routines_queue_create();
+	if (queue == NULL) {
+		object_free(&pool_slab, pool);
+		return NULL;
+	}
+
+	*pool = (routines_pool_t) {
+		.task = task,
+		.min_workers = min_workers,
+		.max_workers = max_workers,
+		.queue = queue,
+		.live = NULL,
+		.retired = NULL,
+		.stats = (routines_pool_stats_t) {0},
+	};
+
+	for (size_t w = 0; w < min_workers; w += 1) {
+		if (!pool_spawn(pool)) {
+			routines_pool_destroy(pool);
+			return NULL;
+		}
+	}
+
+	return pool;
+}
+
+void routines_pool_destroy(routines_pool_t *pool) {
+	assert(pool != NULL);
+
+	while (pool->live != NULL) {
+		pool_worker_t *worker = pool->live;
+		pool_worker_remove(&pool->live, worker);
+		assert(worker->coroutine != current_coroutine);
+		routines_destroy(worker->coroutine);
+		object_free(&worker_slab, worker);
+	}
+	pool_reap(pool);
+
+	routines_queue_destroy(pool->queue);
+	object_free(&pool_slab, pool);
+}
+
+int routines_pool_submit(routines_pool_t *pool, void *work) {
+	assert(pool != NULL);
+	assert(work != NULL);
+
+	pool_reap(pool);
+
+	/* An idle worker takes the work straight away */
+	pool->stats.pending += 1;
+	int error = queue_send(pool->queue, work, NULL, NULL);
+	if (error != 0) {
+		pool->stats.pending -= 1;
+		return error;
+	}
+
+	/* Otherwise grow the pool to meet the queue depth */
+	if (
+		pool->stats.pending > 0
+		&& pool->stats.workers < pool->max_workers
+	) {
+		pool_spawn(pool);
+	}
+
+	return 0;
+}
+
+void routines_pool_stats(
+	routines_pool_t *pool,
+	routines_pool_stats_t *stats
+) {
+	assert(pool != NULL);
+	assert(stats != NULL);
+
+	pool_reap(pool);
+	*stats = pool->stats;
+}
+
+void routines_parallel_for(
+	size_t begin,
+	size_t end,
+	size_t grain,
+	routines_range_t fn,
+	void *ctx
+) {
+	assert(fn != NULL);
+	assert(grain > 0);
+
+	if (begin >= end) {
+		return;
+	}
+
+	parallel_t loop = {
+		.begin = begin,
+		.end = end,
+		.grain = grain,
+		.chunks = (end - begin + grain - 1) / grain,
+		.fn = fn,
+		.map = NULL,
+		.combine = NULL,
+		.results = NULL,
+		.result = NULL,
+		.ctx = ctx,
+	};
+	atomic_init(&loop.next_chunk, 0);
+
+	parallel(&loop, parallel_jobs(&loop));
+}
+
+void *routines_parallel_reduce(
+	size_t begin,
+	size_t end,
+	size_t grain,
+	routines_map_t map,
+	routines_combine_t combine,
+	void *ctx
+) {
+	assert(map != NULL);
+	assert(combine != NULL);
+	assert(grain > 0);
+
+	if (begin >= end) {
+		return NULL;
+	}
+
+	parallel_t loop = {
+		.begin = begin,
+		.end = end,
+		.grain = grain,
+		.chunks = (end - begin + grain - 1) / grain,
+		.fn = NULL,
+		.map = map,
+		.combine = combine,
+		.results = NULL,
+		.result = NULL,
+		.ctx = ctx,
+	};
+	atomic_init(&loop.next_chunk, 0);
+
+	/* Results are only kept when chunks may complete out of order */
+	size_t jobs = parallel_jobs(&loop);
+	if (jobs > 0) {
+		loop.results = malloc(loop.chunks * sizeof(void *));
+		if (loop.results == NULL) {
+			jobs = 0;
+		}
+	}
+
+	parallel(&loop, jobs);
+
+	if (loop.results != NULL) {
+		loop.result = loop.results[0];
+		for (size_t c = 1; c < loop.chunks; c += 1) {
+			loop.result = combine(loop.result, loop.results[c], ctx);
+		}
+		free(loop.results);
+	}
+
+	return loop.result;
+}
+
+routines_ratelimit_t *routines_ratelimit_create(
+	uint64_t rate,
+	uint64_t burst
+) {
+	assert(rate > 0);
+	assert(burst > 0);
+
+	routines_ratelimit_t *limit = object_alloc(&ratelimit_slab);
+	if (limit == NULL) {
+		return NULL;
+	}
+
+	*limit = (routines_ratelimit_t) {
+		.rate = rate,
+		.burst = burst,
+		.tokens = burst,
+		.updated = routines_clock(),
+	};
+	return limit;
+}
+
+void routines_ratelimit_destroy(routines_ratelimit_t *limit) {
+	assert(limit != NULL);
+
+	object_free(&ratelimit_slab, limit);
+}
+
+void routines_ratelimit_acquire(
+	routines_ratelimit_t *limit,
+	uint64_t tokens
+) {
+	assert(current_coroutine != NULL);
+	assert(limit != NULL);
+	assert(tokens <= limit->burst);
+
+	ratelimit_refill(limit);
+
+	/* Promise the tokens now and sleep until they have been gained */
+	limit->tokens -= tokens;
+	if (limit->tokens < 0) {
+		uint64_t wait = -limit->tokens * 1e9 / limit->rate + 1;
+		routines_sleep_until(limit->updated + wait);
+	}
+}
+
+bool routines_ratelimit_try_acquire(
+	routines_ratelimit_t *limit,
+	uint64_t tokens
+) {
+	assert(limit != NULL);
+
+	ratelimit_refill(limit);
+
+	if (limit->tokens < tokens) {
+		return false;
+	}
+
+	limit->tokens -= tokens;
+	return true;
+}
+
+routines_buffers_t *routines_buffers_create(size_t size, size_t max) {
+	assert(size > 0);
+
+	routines_buffers_t *pool = object_alloc(&buffers_slab);
+	if (pool == NULL) {
+		return NULL;
+	}
+
+	/* Unused buffers hold a link and stay aligned for any data */
+	if (size < sizeof(buffer_t)) {
+		size = sizeof(buffer_t);
+	}
+	size = (size + 15) & ~(size_t)15;
+
+	*pool = (routines_buffers_t) {
+		.size = size,
+		.max = max,
+		.allocated = 0,
+		.unused = NULL,
+		.unused_count = 0,
+		.waiting = {NULL, NULL},
+	};
+	return pool;
+}
+
+void routines_buffers_destroy(routines_buffers_t *pool) {
+	assert(pool != NULL);
+	assert(pool->waiting.head == NULL);
+	assert(pool->allocated == pool->unused_count);
+
+	routines_buffers_trim(pool, 0);
+	object_free(&buffers_slab, pool);
+}
+
+void *routines_buffer_take(routines_buffers_t *pool) {
+	assert(pool != NULL);
+
+	while (pool->unused == NULL) {
+		if (pool->max == 0 || pool->allocated < pool->max) {
+			void *buffer = buffer_alloc(pool->size);
+			if (buffer == NULL) {
+				return NULL;
+			}
+			pool->allocated += 1;
+			return buffer;
+		}
+
+		if (current_coroutine == NULL) {
+			errno = EAGAIN;
+			return NULL;
+		}
+		transfer(&pool->waiting, ROUTINES_BLOCKED_IO, NULL);
+	}
+
+	buffer_t *buffer = pool->unused;
+	pool->unused = buffer->next;
+	pool->unused_count -= 1;
+	return buffer;
+}
+
+void routines_buffer_release(routines_buffers_t *pool, void *buffer) {
+	assert(pool != NULL);
+
+	if (buffer == NULL) {
+		return;
+	}
+
+	buffer_t *unused = buffer;
+	unused->next = pool->unused;
+	pool->unused = unused;
+	pool->unused_count += 1;
+
+	/* The waiter takes whichever buffer is unused once it runs */
+	routines_coroutine_t *waiter = coroutine_dequeue(&pool->waiting);
+	if (waiter != NULL) {
+		waiter->state = ROUTINES_RUNNING;
+		coroutine_enqueue(&ready_queue, waiter);
+	}
+}
+
+size_t routines_buffers_trim(routines_buffers_t *pool, size_t keep) {
+	assert(pool != NULL);
+
+#ifdef ROUTINES_STATIC
+	return 0;
+#else
+	size_t released = 0;
+	while (pool->unused_count > keep) {
+		buffer_t *buffer = pool->unused;
+		pool->unused = buffer->next;
+		pool->unused_count -= 1;
+		pool->allocated -= 1;
+		buffer_free(buffer);
+		released += 1;
+	}
+	return released;
+#endif
+}
+
+ssize_t routines_read_pooled(
+	int fd,
+	routines_buffers_t *pool,
+	void **buffer
+) {
+	assert(pool != NULL);
+	assert(buffer != NULL);
+
+	*buffer = NULL;
+
+	while (true) {
+		/* No buffer is held while the descriptor is idle */
+		int error = fd_wait(fd, EPOLLIN);
+		if (error != 0) {
+			errno = error;
+			return -1;
+		}
+
+		void *taken = routines_buffer_take(pool);
+		if (taken == NULL) {
+			return -1;
+		}
+
+		ssize_t bytes;
+		do {
+			bytes = read(fd, taken, pool->size);
+		} while (bytes < 0 && errno == EINTR);
+
+		if (bytes > 0) {
+			*buffer = taken;
+			return bytes;
+		}
+
+		/* Readiness can be spurious for non-blocking descriptors */
+		int read_error = errno;
+		routines_buffer_release(pool, taken);
+		if (bytes == 0) {
+			return 0;
+		}
+		if (read_error != EAGAIN && read_error != EWOULDBLOCK) {
+			errno = read_error;
+			return -1;
+		}
+	}
+}
+
+/*
+ * Internal Implementations
+ */
+
+static int enqueue_message(
+	routines_queue_t *queue,
+	void *message,
+	routines_coroutine_t *sender,
+	routines_queue_t *reply_queue
+) {
+	assert(queue != NULL);
+
+	if (!limit_acquire(ROUTINES_LIMIT_MESSAGES, 1)) {
+		return EAGAIN;
+	}
+
+	message_t *new_tail = object_alloc(&message_slab);
+	if (new_tail == NULL) {
+		limit_release(ROUTINES_LIMIT_MESSAGES, 1);
+		return ENOMEM;
+	}
+
+	*new_tail = (message_t) {
+		.message = message,
+		.sender = sender,
+		.reply_queue = reply_queue,
+		.next = NULL,
+	};
+
+	*queue->tail = new_tail;
+	queue->tail = &new_tail->next;
+
+	if (sender != NULL) {
+		sender->message = &new_tail->sender;
+		transfer(NULL, ROUTINES_BLOCKED_SEND, NULL);
+	}
+
+	return 0;
+}
+
+static void *dequeue_message(
+	routines_queue_t *queue,
+	routines_queue_t **reply_queue
+) {
+	assert(queue != NULL);
+
+	void *message = NULL;
+	message_t *head = queue->head;
+	if (head != NULL) {
+		message = head->message;
+		if (head->sender != NULL) {
+			routines_resume(head->sender);
+		}
+		if (reply_queue != NULL) {
+			*reply_queue = head->reply_queue;
+		}
+		queue->head = head->next;
+		object_free(&message_slab, head);
+		limit_release(ROUTINES_LIMIT_MESSAGES, 1);
+	}
+
+	if (queue->head == NULL) {
+		queue->tail = &queue->head;
+	}
+
+	return message;
+}
+
+static bool pending_messages(routines_queue_t *queue) {
+	return queue != NULL && queue->head != NULL;
+}
+
+static void coroutine_enqueue(
+	coroutine_queue_t *queue,
+	routines_coroutine_t *coroutine
+) {
+	assert(queue != NULL);
+	assert(coroutine != NULL);
+	assert(coroutine->next == NULL);
+	assert(coroutine->prev == NULL);
+	assert(coroutine->queue == NULL);
+
+	if (queue->tail != NULL) {
+		assert(queue->tail->next == NULL);
+		coroutine->prev = queue->tail;
+		queue->tail->next = coroutine;
+	} else {
+		assert(queue->head == NULL);
+		queue->head = coroutine;
+	}
+	queue->tail = coroutine;
+	coroutine->queue = queue;
+}
+
+static routines_coroutine_t *coroutine_dequeue(
+	coroutine_queue_t *queue
+) {
+	assert(queue != NULL);
+	routines_coroutine_t *head = queue->head;
+
+	if (head != NULL) {
+		queue->head = head->next;
+		assert(head->queue == queue);
+		head->queue = NULL;
+		head->next = NULL;
+		if (queue->head != NULL) {
+			queue->head->prev = NULL;
+		}
+	}
+
+	if (queue->head == NULL) {
+		queue->tail = NULL;
+	}
+
+	return head;
+}
+
+static void coroutine_remove(routines_coroutine_t *coroutine) {
+	assert(coroutine != NULL);
+	assert(coroutine->queue != NULL);
+
+	coroutine_queue_t *queue = coroutine->queue;
+
+	if (coroutine->prev != NULL) {
+		coroutine->prev->next = coroutine->next;
+	} else {
+		assert(queue->head == coroutine);
+		queue->head = coroutine->next;
+	}
+
+	if (coroutine->next != NULL) {
+		coroutine->next->prev = coroutine->prev;
+	} else {
+		assert(queue->tail == coroutine);
+		queue->tail = coroutine->prev;
+	}
+
+	coroutine->next = NULL;
+	coroutine->prev = NULL;
+	coroutine->queue = NULL;
+}
+
+static void sleep_enqueue(routines_coroutine_t *coroutine) {
+	assert(coroutine != NULL);
+	assert(coroutine->next == NULL);
+	assert(coroutine->prev == NULL);
+	assert(coroutine->queue == NULL);
+
+	/* Most sleepers wake after those already sleeping */
+	routines_coroutine_t *prev = sleep_queue.tail;
+	while (prev != NULL && prev->deadline > coroutine->deadline) {
+		prev = prev->prev;
+	}
+
+	coroutine->prev = prev;
+	if (prev != NULL) {
+		coroutine->next = prev->next;
+		prev->next = coroutine;
+	} else {
+		coroutine->next = sleep_queue.head;
+		sleep_queue.head = coroutine;
+	}
+
+	if (coroutine->next != NULL) {
+		coroutine->next->prev = coroutine;
+	} else {
+		sleep_queue.tail = coroutine;
+	}
+
+	coroutine->queue = &sleep_queue;
+}
+
+static void wake_sleepers(void) {
+	if (sleep_queue.head == NULL) {
+		return;
+	}
+
+	uint64_t now = routines_clock();
+	while (sleep_queue.head != NULL && sleep_queue.head->deadline <= now) {
+		routines_coroutine_t *sleeper = coroutine_dequeue(&sleep_queue);
+		sleeper->state = ROUTINES_RUNNING;
+		coroutine_enqueue(&ready_queue, sleeper);
+	}
+}
+
+static void ratelimit_refill(routines_ratelimit_t *limit) {
+	uint64_t now = routines_clock();
+
+	limit->tokens += (now - limit->updated) * limit->rate / 1e9;
+	if (limit->tokens > limit->burst) {
+		limit->tokens = limit->burst;
+	}
+	limit->updated = now;
+}
+
+static routines_scheduler_t *scheduler_self(void) {
+	if (this_scheduler != NULL) {
+		return this_scheduler;
+	}
+
+	pthread_once(&schedulers.key_once, scheduler_key_create);
+
+	pthread_mutex_lock(&schedulers.lock);
+
+	routines_scheduler_t *scheduler = object_alloc(&scheduler_slab);
+	if (scheduler == NULL) {
+		pthread_mutex_unlock(&schedulers.lock);
+		return NULL;
+	}
+
+	*scheduler = (routines_scheduler_t) {
+		.incoming = (coroutine_queue_t) {
+			.head = NULL,
+			.tail = NULL,
+		},
+		.completed = NULL,
+		.wake_fd = -1,
+		.next = schedulers.head,
+	};
+	pthread_mutex_init(&scheduler->lock, NULL);
+	atomic_init(&scheduler->migrated, false);
+	atomic_init(&scheduler->completions, false);
+	atomic_init(&scheduler->load, 0);
+	atomic_init(&scheduler->refs, 1);
+	schedulers.head = scheduler;
+
+	pthread_mutex_unlock(&schedulers.lock);
+
+	pthread_setspecific(schedulers.key, scheduler);
+	this_scheduler = scheduler;
+
+	return scheduler;
+}
+
+static void scheduler_key_create(void) {
+	pthread_key_create(&schedulers.key, scheduler_release);
+}
+
+static void scheduler_release(void *arg) {
+	routines_scheduler_t *scheduler = arg;
+
+	pthread_mutex_lock(&schedulers.lock);
+	for (
+		routines_scheduler_t **list = &schedulers.head;
+		*list != NULL;
+		list = &(*list)->next
+	) {
+		if (*list == scheduler) {
+			*list = scheduler->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&schedulers.lock);
+
+	reactor_stop();
+	routines_pressure_unwatch();
+	log_exit();
+	log_release();
+	trim_stacks(0);
+
+	/* Co-routines suspended or migrated away may still refer to it */
+	this_scheduler = NULL;
+	scheduler_drop(scheduler);
+}
+
+static void scheduler_hold(routines_scheduler_t *scheduler) {
+	atomic_fetch_add_explicit(&scheduler->refs, 1, memory_order_relaxed);
+}
+
+static void scheduler_drop(routines_scheduler_t *scheduler) {
+	if (atomic_fetch_sub(&scheduler->refs, 1) == 1) {
+		pthread_mutex_destroy(&scheduler->lock);
+		object_free(&scheduler_slab, scheduler);
+	}
+}
+
+static void scheduler_enqueue(
+	routines_scheduler_t *scheduler,
+	routines_coroutine_t *coroutine
+) {
+	pthread_mutex_lock(&scheduler->lock);
+	coroutine_enqueue(&scheduler->incoming, coroutine);
+	atomic_store(&scheduler->migrated, true);
+	if (scheduler->wake_fd >= 0) {
+		eventfd_write(scheduler->wake_fd, 1);
+	}
+	pthread_mutex_unlock(&scheduler->lock);
+}
+
+static void accept_migrated(void) {
+	routines_scheduler_t *self = this_scheduler;
+
+	if (
+		self == NULL
+		|| !atomic_load_explicit(&self->migrated, memory_order_relaxed)
+	) {
+		return;
+	}
+
+	pthread_mutex_lock(&self->lock);
+	routines_coroutine_t *coroutine = coroutine_dequeue(&self->incoming);
+	while (coroutine != NULL) {
+		if (coroutine->state != ROUTINES_SUSPENDED) {
+			coroutine_enqueue(&ready_queue, coroutine);
+		}
+		coroutine = coroutine_dequeue(&self->incoming);
+	}
+	atomic_store(&self->migrated, false);
+	pthread_mutex_unlock(&self->lock);
+}
+
+static void suspend_all(coroutine_queue_t *queue) {
+	routines_coroutine_t *coroutine = coroutine_dequeue(queue);
+	while (coroutine != NULL) {
+		coroutine->state = ROUTINES_SUSPENDED;
+		coroutine->wait_fd = -1;
+		coroutine = coroutine_dequeue(queue);
+	}
+}
+
+static int reactor_start(void) {
+	if (reactor.poll_fd >= 0) {
+		return 0;
+	}
+
+	routines_scheduler_t *scheduler = scheduler_self();
+	if (scheduler == NULL) {
+		return ENOMEM;
+	}
+
+	int poll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (poll_fd < 0) {
+		return errno;
+	}
+
+	int wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	struct epoll_event event = {
+		.events = EPOLLIN,
+		.data.ptr = scheduler,
+	};
+	if (
+		wake_fd < 0
+		|| epoll_ctl(poll_fd, EPOLL_CTL_ADD, wake_fd, &event) != 0
+	) {
+		int error = errno;
+		if (wake_fd >= 0) {
+			close(wake_fd);
+		}
+		close(poll_fd);
+		return error;
+	}
+
+	/* A trigger kept across a fork is watched by the new instance */
+	if (reactor.pressure_fd >= 0) {
+		event = (struct epoll_event) {
+			.events = EPOLLPRI,
+			.data.ptr = &reactor,
+		};
+		epoll_ctl(poll_fd, EPOLL_CTL_ADD, reactor.pressure_fd, &event);
+	}
+
+	pthread_mutex_lock(&scheduler->lock);
+	scheduler->wake_fd = wake_fd;
+	pthread_mutex_unlock(&scheduler->lock);
+
+	reactor.poll_fd = poll_fd;
+
+	return 0;
+}
+
+static void reactor_stop(void) {
+	if (reactor.poll_fd < 0) {
+		return;
+	}
+
+	routines_scheduler_t *scheduler = this_scheduler;
+	pthread_mutex_lock(&scheduler->lock);
+	close(scheduler->wake_fd);
+	scheduler->wake_fd = -1;
+	pthread_mutex_unlock(&scheduler->lock);
+
+	close(reactor.poll_fd);
+	reactor.poll_fd = -1;
+}
+
+static void reactor_wait(int timeout) {
+	if (reactor.poll_fd < 0) {
+		/* Sleepers can still be waited for without a reactor */
+		if (timeout > 0) {
+			struct timespec duration = {
+				.tv_sec = timeout / 1000,
+				.tv_nsec = (timeout % 1000) * 1000000L,
+			};
+			nanosleep(&duration, NULL);
+		}
+		return;
+	}
+
+	struct epoll_event events[64];
+	int count = epoll_wait(reactor.poll_fd, events, 64, timeout);
+
+	for (int e = 0; e < count; e += 1) {
+		void *source = events[e].data.ptr;
+
+		if (source == this_scheduler) {
+			eventfd_t value;
+			eventfd_read(this_scheduler->wake_fd, &value);
+		} else if (source == &reactor) {
+			routines_trim(0);
+		} else {
+			routines_coroutine_t *waiter = source;
+			coroutine_remove(waiter);
+			waiter->wait_fd = -1;
+			waiter->revents = events[e].events;
+			waiter->state = ROUTINES_RUNNING;
+			coroutine_enqueue(&ready_queue, waiter);
+		}
+	}
+
+	accept_migrated();
+	accept_completed();
+	wake_sleepers();
+}
+
+static int fd_wait(int fd, uint32_t events) {
+	if (current_coroutine != NULL) {
+		return routines_wait_fd(fd, events, NULL);
+	}
+
+	struct pollfd poll_fd = {
+		.fd = fd,
+		.events = (events & EPOLLIN ? POLLIN : 0)
+			| (events & EPOLLOUT ? POLLOUT : 0),
+	};
+	while (poll(&poll_fd, 1, -1) < 0) {
+		if (errno != EINTR) {
+			return errno;
+		}
+	}
+
+	return 0;
+}
+
+static ssize_t send_segments_batched(
+	int fd,
+	const unsigned char *buf,
+	size_t len,
+	size_t segment,
+	const struct sockaddr *addr,
+	socklen_t addrlen
+) {
+	struct iovec iov[DATAGRAM_BATCH];
+	struct mmsghdr msgs[DATAGRAM_BATCH];
+	size_t sent = 0;
+
+	while (sent < len) {
+		unsigned int count = 0;
+		for (
+			size_t offset = sent;
+			offset < len && count < DATAGRAM_BATCH;
+			offset += segment
+		) {
+			size_t bytes = len - offset < segment ? len - offset : segment;
+			iov[count] = (struct iovec) {
+				.iov_base = (void *)(buf + offset),
+				.iov_len = bytes,
+			};
+			msgs[count] = (struct mmsghdr) {
+				.msg_hdr = {
+					.msg_name = (void *)addr,
+					.msg_namelen = addrlen,
+					.msg_iov = &iov[count],
+					.msg_iovlen = 1,
+				},
+			};
+			count += 1;
+		}
+
+		int done = routines_send_datagrams(fd, msgs, count);
+		for (int m = 0; m < done; m += 1) {
+			sent += msgs[m].msg_len;
+		}
+		if (done < (int)count) {
+			return sent > 0 ? (ssize_t)sent : -1;
+		}
+	}
+
+	return sent;
+}
+
+static void fork_prepare(void) {
+	/* Keep shared lists consistent across the fork */
+	pthread_mutex_lock(&schedulers.lock);
+	pthread_mutex_lock(&helpers.lock);
+	pthread_mutex_lock(&io_helpers.lock);
+}
+
+static void fork_parent(void) {
+	pthread_mutex_unlock(&io_helpers.lock);
+	pthread_mutex_unlock(&helpers.lock);
+	pthread_mutex_unlock(&schedulers.lock);
+}
+
+static void fork_child(void) {
+	pthread_mutex_unlock(&io_helpers.lock);
+	pthread_mutex_unlock(&helpers.lock);
+	pthread_mutex_unlock(&schedulers.lock);
+	routines_fork_child(fork_keep_stacks);
+}
+
+static bool limit_acquire(routines_limit_t limit, size_t amount) {
+	size_t hard = atomic_load_explicit(
+		&limits.hard[limit],
+		memory_order_relaxed
+	);
+	size_t usage = atomic_fetch_add(&limits.usage[limit], amount) + amount;
+
+	if (hard != 0 && usage > hard) {
+		atomic_fetch_sub(&limits.usage[limit], amount);
+		return false;
+	}
+
+	limit_overload(limit, usage, amount);
+	return true;
+}
+
+static void limit_release(routines_limit_t limit, size_t amount) {
+	atomic_fetch_sub(&limits.usage[limit], amount);
+}
+
+static void limit_overload(
+	routines_limit_t limit,
+	size_t usage,
+	size_t amount
+) {
+	size_t soft = atomic_load_explicit(
+		&limits.soft[limit],
+		memory_order_relaxed
+	);
+	if (soft == 0 || usage <= soft || usage - amount > soft) {
+		return;
+	}
+
+	/* The handler is called unlocked so that it may change the handler */
+	pthread_mutex_lock(&limits.lock);
+	routines_overload_t handler = limits.handler;
+	void *ctx = limits.ctx;
+	pthread_mutex_unlock(&limits.lock);
+
+	if (handler != NULL) {
+		handler(limit, usage, ctx);
+	}
+}
+
+static int find_object(struct dl_phdr_info *info, size_t size, void *arg) {
+	object_search_t *search = arg;
+
+	/* Name each object the same way dladdr did when it was saved */
+	for (size_t p = 0; p < info->dlpi_phnum; p += 1) {
+		if (info->dlpi_phdr[p].p_type == PT_LOAD) {
+			Dl_info object;
+			void *address = (void *)(
+				info->dlpi_addr + info->dlpi_phdr[p].p_vaddr
+			);
+			if (
+				dladdr(address, &object) != 0
+				&& object.dli_fname != NULL
+				&& strcmp(object.dli_fname, search->path) == 0
+			) {
+				search->base = (uintptr_t)object.dli_fbase;
+				search->identity_size
+					= object_identity(info, search->identity);
+				return 1;
+			}
+			break;
+		}
+	}
+
+	return 0;
+}
+
+static size_t object_identity(
+	struct dl_phdr_info *info,
+	unsigned char identity[CHECKPOINT_IDENTITY]
+) {
+	for (size_t p = 0; p < info->dlpi_phnum; p += 1) {
+		const ElfW(Phdr) *phdr = &info->dlpi_phdr[p];
+		if (phdr->p_type != PT_NOTE) {
+			continue;
+		}
+
+		const unsigned char *note
+			= (const unsigned char *)(info->dlpi_addr + phdr->p_vaddr);
+		const unsigned char *end = note + phdr->p_memsz;
+		while (note + sizeof(ElfW(Nhdr)) <= end) {
+			const ElfW(Nhdr) *header = (const ElfW(Nhdr) *)note;
+			const unsigned char *name = note + sizeof(ElfW(Nhdr));
+			const unsigned char *desc = name + ((header->n_namesz + 3) & ~3);
+			note = desc + ((header->n_descsz + 3) & ~3);
+			if (note > end) {
+				break;
+			}
+
+			if (
+				header->n_type == NT_GNU_BUILD_ID
+				&& header->n_namesz == sizeof(ELF_NOTE_GNU)
+				&& memcmp(name, ELF_NOTE_GNU, sizeof(ELF_NOTE_GNU)) == 0
+			) {
+				size_t size = header->n_descsz;
+				if (size > CHECKPOINT_IDENTITY) {
+					size = CHECKPOINT_IDENTITY;
+				}
+				memcpy(identity, desc, size);
+				return size;
+			}
+		}
+	}
+
+	/* FNV-1a over the code of an object linked without a build ID */
+	uint64_t hash = 0xcbf29ce484222325;
+	for (size_t p = 0; p < info->dlpi_phnum; p += 1) {
+		const ElfW(Phdr) *phdr = &info->dlpi_phdr[p];
+		if (phdr->p_type != PT_LOAD || (phdr->p_flags & PF_X) == 0) {
+			continue;
+		}
+
+		const unsigned char *code
+			= (const unsigned char *)(info->dlpi_addr + phdr->p_vaddr);
+		for (size_t b = 0; b < phdr->p_filesz; b += 1) {
+			hash = (hash ^ code[b]) * 0x100000001b3;
+		}
+	}
+
+	memcpy(identity, &hash, sizeof(hash));
+	return sizeof(hash);
+}
+
+static void *object_alloc(object_slab_t *slab) {
+	assert(slab != NULL);
+
+#ifdef ROUTINES_STATIC
+	while (atomic_flag_test_and_set_explicit(&slab->lock, memory_order_acquire));
+
+	void *object = slab->unused;
+	if (object != NULL) {
+		slab->unused = *(void **)object;
+	} else if (slab->used < slab->count) {
+		object = slab->slots + slab->used * slab->size;
+		slab->used += 1;
+	}
+
+	atomic_flag_clear_explicit(&slab->lock, memory_order_release);
+	return object;
+#else
+	return malloc(slab->size);
+#endif
+}
+
+static void object_free(object_slab_t *slab, void *object) {
+	assert(slab != NULL);
+
+#ifdef ROUTINES_STATIC
+	while (atomic_flag_test_and_set_explicit(&slab->lock, memory_order_acquire));
+
+	*(void **)object = slab->unused;
+	slab->unused = object;
+
+	atomic_flag_clear_explicit(&slab->lock, memory_order_release);
+#else
+	free(object);
+#endif
+}
+
+static routines_source_t *source_create(
+	int kind,
+	int fd,
+	routines_queue_t *queue
+) {
+	routines_source_t *source = object_alloc(&source_slab);
+	if (source == NULL) {
+		close(fd);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	*source = (routines_source_t) {
+		.kind = kind,
+		.fd = fd,
+		.queue = queue,
+		.reader = NULL,
+	};
+
+	int error = routines_spawn_ex(&source->reader, source_run, source);
+	if (error != 0) {
+		close(fd);
+		object_free(&source_slab, source);
+		errno = error;
+		return NULL;
+	}
+
+	return source;
+}
+
+static void source_run(void *arg) {
+	routines_source_t *source = arg;
+
+	while (true) {
+		if (routines_wait_fd(source->fd, EPOLLIN, NULL) != 0) {
+			return;
+		}
+
+		void *message;
+		int error = source_read(source, &message);
+		if (error == EAGAIN) {
+			continue;
+		} else if (error != 0) {
+			return;
+		}
+
+		/* Events are dropped while the message limit is reached */
+		routines_signal(source->queue, message);
+
+		if (source->kind == SOURCE_CHILD) {
+			return;
+		}
+	}
+}
+
+static int source_read(routines_source_t *source, void **message) {
+	switch (source->kind) {
+	case SOURCE_SIGNAL: {
+		struct signalfd_siginfo info;
+		if (read(source->fd, &info, sizeof(info)) != sizeof(info)) {
+			return errno == EINTR ? EAGAIN : errno;
+		}
+		*message = (void *)(uintptr_t)info.ssi_signo;
+		return 0;
+	}
+	case SOURCE_TIMER:
+	case SOURCE_EVENT: {
+		uint64_t count;
+		if (read(source->fd, &count, sizeof(count)) != sizeof(count)) {
+			return errno == EINTR ? EAGAIN : errno;
+		}
+		*message = (void *)(uintptr_t)count;
+		return 0;
+	}
+	case SOURCE_CHILD: {
+		siginfo_t info = {0};
+		if (waitid(P_PIDFD, source->fd, &info, WEXITED | WNOHANG) != 0) {
+			return errno == EINTR ? EAGAIN : errno;
+		}
+		if (info.si_pid == 0) {
+			return EAGAIN;
+		}
+
+		/* Encoded as by waitpid so that WIFEXITED and co. apply */
+		int status;
+		if (info.si_code == CLD_EXITED) {
+			status = (info.si_status & 0xff) << 8;
+		} else {
+			status = info.si_status & 0x7f;
+			if (info.si_code == CLD_DUMPED) {
+				status |= 0x80;
+			}
+		}
+		*message = (void *)(uintptr_t)status;
+		return 0;
+	}
+	default:
+		return EINVAL;
+	}
+}
+
+static log_t *log_self(void) {
+	if (thread_log != NULL) {
+		return thread_log;
+	}
+
+	/* The log is released along with the scheduler as the thread exits */
+	if (scheduler_self() == NULL) {
+		return NULL;
+	}
+
+	log_t *log = object_alloc(&log_slab);
+	if (log == NULL) {
+		return NULL;
+	}
+
+	log->active = 0;
+	log->used = 0;
+	log->first = 0;
+	log->pending = 0;
+	log->writing = false;
+	log->writer = NULL;
+	log->waiting = (coroutine_queue_t) {NULL, NULL};
+	thread_log = log;
+
+	/* Threads have their logs written as they exit, including main */
+	pthread_once(&log_config.exit_once, log_register_exit);
+
+	return log;
+}
+
+static void log_wake(log_t *log) {
+	if (log->writer == NULL) {
+		if (routines_spawn_ex(&log->writer, log_writer, log) != 0) {
+			/* Without a writer each batch is written as it fills */
+			log->writer = NULL;
+			size_t batch = atomic_load(&log_config.batch);
+			if (log->pending == 0 && log->used >= batch) {
+				log_swap(log);
+			}
+			if (log->pending > 0 && !log->writing) {
+				log_write(log);
+			}
+			return;
+		}
+	}
+
+	routines_coroutine_t *writer = log->writer;
+	if (writer == current_coroutine) {
+		return;
+	}
+
+	/* The writer may be waiting for a write, which it can't leave */
+	routines_state_t state = writer->state;
+	if (
+		state == ROUTINES_SUSPENDED
+		|| (
+			state == ROUTINES_BLOCKED_SLEEP
+			&& (
+				log->pending > 0
+				|| log->used >= atomic_load(&log_config.batch)
+			)
+		)
+	) {
+		routines_resume(writer);
+	}
+}
+
+static void log_wait(log_t *log) {
+	if (current_coroutine == NULL) {
+		routines_poll();
+	} else {
+		transfer(&log->waiting, ROUTINES_BLOCKED_IO, NULL);
+	}
+}
+
+static void log_swap(log_t *log) {
+	assert(log->pending == 0);
+	assert(log->used > 0);
+
+	log->pending = log->used;
+	log->active ^= 1;
+	log->used = 0;
+}
+
+static void log_write(log_t *log) {
+	assert(log->pending > 0);
+	assert(!log->writing);
+
+	char *buffer = log->buffers[log->active ^ 1];
+	size_t size = log->pending;
+	int fd = atomic_load(&log_config.fd);
+
+	log->writing = true;
+
+	/* Written by an I/O thread so that other co-routines keep running */
+	while (size > 0) {
+		file_request_t request = {
+			.operation = FILE_WRITE,
+			.fd = fd,
+			.buf = buffer,
+			.count = size,
+		};
+		ssize_t written = file_io(&request);
+		if (written < 0) {
+			if (errno != EAGAIN || fd_wait(fd, EPOLLOUT) != 0) {
+				break;
+			}
+			continue;
+		}
+		buffer += written;
+		size -= written;
+	}
+
+	log->pending = 0;
+	log->writing = false;
+
+	routines_coroutine_t *waiter = coroutine_dequeue(&log->waiting);
+	while (waiter != NULL) {
+		waiter->state = ROUTINES_RUNNING;
+		coroutine_enqueue(&ready_queue, waiter);
+		waiter = coroutine_dequeue(&log->waiting);
+	}
+}
+
+static void log_writer(void *arg) {
+	log_t *log = arg;
+	routines_coroutine_t *self = current_coroutine;
+
+	while (log->writer == self) {
+		if (log->pending > 0) {
+			if (log->writing) {
+				transfer(&log->waiting, ROUTINES_BLOCKED_IO, NULL);
+			} else {
+				log_write(log);
+			}
+			continue;
+		}
+
+		if (log->used == 0) {
+			routines_suspend(self);
+			continue;
+		}
+
+		/* Wait for a full batch or for the first record to be due */
+		uint64_t deadline = log->first + atomic_load(&log_config.interval);
+		if (
+			log->used < atomic_load(&log_config.batch)
+			&& routines_clock() < deadline
+		) {
+			routines_sleep_until(deadline);
+			continue;
+		}
+
+		log_swap(log);
+	}
+}
+
+static void log_exit(void) {
+	log_t *log = thread_log;
+	if (log == NULL || log->writing) {
+		return;
+	}
+
+	int fd = atomic_load(&log_config.fd);
+
+	/* Records handed over to the writer are older than the rest */
+	if (log->pending == 0 && log->used > 0) {
+		log_swap(log);
+	}
+	while (log->pending > 0) {
+		char *buffer = log->buffers[log->active ^ 1];
+		size_t size = log->pending;
+
+		log->pending = 0;
+		while (size > 0) {
+			ssize_t written = write(fd, buffer, size);
+			if (written < 0 && errno == EINTR) {
+				continue;
+			} else if (written < 0) {
+				break;
+			}
+			buffer += written;
+			size -= written;
+		}
+
+		if (log->used > 0) {
+			log_swap(log);
+		}
+	}
+}
+
+static void log_release(void) {
+	log_t *log = thread_log;
+	if (log == NULL || log->writing) {
+		return;
+	}
+
+	/* A writer waiting for a write or running the exit is left behind */
+	routines_coroutine_t *writer = log->writer;
+	if (writer != NULL) {
+		if (writer == current_coroutine || writer->file_io) {
+			return;
+		}
+		routines_destroy(writer);
+	}
+
+	thread_log = NULL;
+	object_free(&log_slab, log);
+}
+
+static void log_register_exit(void) {
+	atexit(log_exit);
+}
+
+static void *buffer_alloc(size_t size) {
+#ifdef ROUTINES_STATIC
+	size_t used = atomic_load(&buffer_arena_used);
+	do {
+		if (size > ROUTINES_BUFFER_BYTES - used) {
+			errno = ENOMEM;
+			return NULL;
+		}
+	} while (!atomic_compare_exchange_weak(
+		&buffer_arena_used,
+		&used,
+		used + size
+	));
+
+	return buffer_arena + used;
+#else
+	return malloc(size);
+#endif
+}
+
+#ifndef ROUTINES_STATIC
+static void buffer_free(void *buffer) {
+	free(buffer);
+}
+#endif
+
+static int alloc_stack(unsigned char **stack_base) {
+	unsigned char *stack = pop_stack();
+
+	if (stack == NULL) {
+#ifdef ROUTINES_STATIC
+		if (!limit_acquire(ROUTINES_LIMIT_STACK_BYTES, STACK_SIZE)) {
+			return EAGAIN;
+		}
+
+		size_t slot = atomic_fetch_add(&stacks_used, 1);
+		if (slot >= ROUTINES_MAX_COROUTINES) {
+			atomic_fetch_sub(&stacks_used, 1);
+			limit_release(ROUTINES_LIMIT_STACK_BYTES, STACK_SIZE);
+			return ENOMEM;
+		}
+		stack = stack_slots[slot];
+#else
+		if (reserved_count == 0) {
+			int error = reserve_stacks();
+			if (error != 0) {
+				return error;
+			}
+		}
+
+		stack = reserved_stacks + (reserved_count - 1) * STACK_SIZE;
+#ifndef ROUTINES_NO_GUARD_PAGES
+		/* A guard page splits the chunk's mapping around every stack */
+		if (mprotect(stack, 4096, PROT_NONE) != 0) {
+			return ENOMEM;
+		}
+#endif
+		reserved_count -= 1;
+#endif
+		stack += STACK_SIZE;
+	}
+
+	*stack_base = stack;
+	return 0;
+}
+
+static void free_stack(unsigned char *stack_base) {
+	push_stack(stack_base);
+}
+
+#ifndef ROUTINES_STATIC
+static int reserve_stacks(void) {
+	size_t count = ROUTINES_STACK_CHUNK;
+	if (!limit_acquire(ROUTINES_LIMIT_STACK_BYTES, count * STACK_SIZE)) {
+		count = 1;
+		if (!limit_acquire(ROUTINES_LIMIT_STACK_BYTES, STACK_SIZE)) {
+			return EAGAIN;
+		}
+	}
+
+	/*
+	 * Plain mappings rather than growable ones, for which the kernel
+	 * keeps a gap below each that makes finding space for the next
+	 * slower the more stacks are mapped
+	 */
+	unsigned char *chunk = mmap(
+		NULL,
+		count * STACK_SIZE,
+		PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK,
+		0, 0
+	);
+	if (chunk == MAP_FAILED && count > 1) {
+		limit_release(ROUTINES_LIMIT_STACK_BYTES, (count - 1) * STACK_SIZE);
+		count = 1;
+		chunk = mmap(
+			NULL,
+			STACK_SIZE,
+			PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK,
+			0, 0
+		);
+	}
+	if (chunk == MAP_FAILED) {
+		limit_release(ROUTINES_LIMIT_STACK_BYTES, STACK_SIZE);
+		return ENOMEM;
+	}
+
+	/* Huge pages would make each stack's first touch fault in many */
+	madvise(chunk, count * STACK_SIZE, MADV_NOHUGEPAGE);
+
+	reserved_stacks = chunk;
+	reserved_count = count;
+	return 0;
+}
+
+static size_t release_reserved(size_t keep) {
+	if (reserved_count <= keep) {
+		return 0;
+	}
+
+	size_t released = reserved_count - keep;
+	munmap(reserved_stacks, released * STACK_SIZE);
+	limit_release(ROUTINES_LIMIT_STACK_BYTES, released * STACK_SIZE);
+
+	reserved_stacks += released * STACK_SIZE;
+	reserved_count = keep;
+	return released;
+}
+#endif
+
+static size_t trim_stacks(size_t keep) {
+	unused_stack_t **unused = &unused_stacks;
+	while (*unused != NULL && keep > 0) {
+		unused = &(*unused)->next;
+		keep -= 1;
+	}
+
+	size_t trimmed = 0;
+#ifdef ROUTINES_STATIC
+	/* Static stacks can't be unmapped, only have their pages dropped */
+	for (unused_stack_t *stack = *unused; stack != NULL; stack = stack->next) {
+		unsigned char *stack_base = (unsigned char *)(stack + 1);
+		madvise(
+			stack_base - STACK_SIZE,
+			STACK_SIZE - 4096,
+			MADV_DONTNEED
+		);
+		trimmed += 1;
+	}
+#else
+	unused_stack_t *stack = *unused;
+	*unused = NULL;
+	while (stack != NULL) {
+		unsigned char *stack_base = (unsigned char *)(stack + 1);
+		stack = stack->next;
+		munmap(stack_base - STACK_SIZE, STACK_SIZE);
+		limit_release(ROUTINES_LIMIT_STACK_BYTES, STACK_SIZE);
+		trimmed += 1;
+	}
+	trimmed += release_reserved(keep);
+#endif
+
+	return trimmed;
+}
+
+static void push_stack(unsigned char *stack_base) {
+	unused_stack_t *stack = (unused_stack_t *)stack_base - 1;
+	*stack = (unused_stack_t) {
+		.next = unused_stacks,
+	};
+	unused_stacks = stack;
+}
+
+static unsigned char *pop_stack(void) {
+	unsigned char *stack_base = NULL;
+	unused_stack_t *stack = unused_stacks;
 
-	if (pending_messages(queue)) {
-		return recv(queue, NULL);
-	} else {
-		return NULL;
+	if (stack != NULL) {
+		stack_base = (unsigned char *)(stack + 1);
+		unused_stacks = stack->next;
 	}
+
+	return stack_base;
 }
 
-void *routines_call(
+static int queue_send(
 	routines_queue_t *send_queue,
 	void *message,
+	routines_coroutine_t *sender,
 	routines_queue_t *reply_queue
 ) {
-	assert(current_coroutine != NULL);
 	assert(send_queue != NULL);
-	assert(reply_queue != NULL);
 
-	send(send_queue, message, NULL, reply_queue);
-	return recv(reply_queue, NULL);
+	routines_coroutine_t *server = coroutine_dequeue(&send_queue->recv_queue);
+	if (server == NULL) {
+		return enqueue_message(send_queue, message, sender, reply_queue);
+	}
+
+	handoff(server, message, reply_queue);
+
+	/*
+	 * A server replying to a call keeps running so that it is waiting
+	 * for the next request by the time the caller makes it
+	 */
+	if (server->handoff.calling) {
+		server->state = ROUTINES_RUNNING;
+		coroutine_enqueue(&ready_queue, server);
+	} else {
+		transfer(&ready_queue, ROUTINES_RUNNING, server);
+	}
+
+	return 0;
 }
 
-void *routines_recv(
+static void *queue_recv(
 	routines_queue_t *recv_queue,
 	routines_queue_t **reply_queue
 ) {
-	assert(current_coroutine != NULL);
 	assert(recv_queue != NULL);
 
-	return recv(recv_queue, reply_queue);
+	if (!pending_messages(recv_queue)) {
+		return recv_blocked(recv_queue, reply_queue, NULL);
+	}
+
+	return dequeue_message(recv_queue, reply_queue);
 }
 
-void routines_post(
-	routines_queue_t *send_queue,
+static void handoff(
+	routines_coroutine_t *server,
 	void *message,
 	routines_queue_t *reply_queue
 ) {
-	assert(current_coroutine != NULL);
-	assert(send_queue != NULL);
+	assert(server != NULL);
+	assert(server->state == ROUTINES_BLOCKED_RECV);
 
-	send(send_queue, message, NULL, reply_queue);
+	server->handoff.ready = true;
+	server->handoff.message = message;
+	server->handoff.reply_queue = reply_queue;
 }
 
-/*
- * Internal Implementations
- */
-
-static void enqueue_message(
-	routines_queue_t *queue,
-	void *message,
-	routines_coroutine_t *sender,
-	routines_queue_t *reply_queue
+static void *recv_blocked(
+	routines_queue_t *recv_queue,
+	routines_queue_t **reply_queue,
+	routines_coroutine_t *coroutine
 ) {
-	assert(queue != NULL);
+	assert(recv_queue != NULL);
+	assert(!pending_messages(recv_queue));
 
-	message_t *new_tail = malloc(sizeof(message_t));
-	*new_tail = (message_t) {
-		.message = message,
-		.sender = sender,
-		.reply_queue = reply_queue,
-		.next = NULL,
-	};
+	routines_coroutine_t *self = current_coroutine;
+	self->handoff.ready = false;
 
-	*queue->tail = new_tail;
-	queue->tail = &new_tail->next;
+	transfer(&recv_queue->recv_queue, ROUTINES_BLOCKED_RECV, coroutine);
 
-	if (sender != NULL) {
-		sender->message = &new_tail->sender;
-		transfer(NULL, ROUTINES_BLOCKED_SEND, NULL);
+	if (self->handoff.ready) {
+		self->handoff.ready = false;
+		if (reply_queue != NULL) {
+			*reply_queue = self->handoff.reply_queue;
+		}
+		return self->handoff.message;
+	}
+
+	/* Resumed without a message */
+	if (reply_queue != NULL) {
+		*reply_queue = NULL;
 	}
+	return dequeue_message(recv_queue, reply_queue);
 }
 
-static void *dequeue_message(
-	routines_queue_t *queue,
-	routines_queue_t **reply_queue
-) {
-	assert(queue != NULL);
+static bool pool_spawn(routines_pool_t *pool) {
+	assert(pool != NULL);
 
-	void *message = NULL;
-	message_t *head = queue->head;
-	if (head != NULL) {
-		message = head->message;
-		if (head->sender != NULL) {
-			routines_resume(head->sender);
+	pool_worker_t *worker = object_alloc(&worker_slab);
+	if (worker == NULL) {
+		return false;
+	}
+
+	*worker = (pool_worker_t) {
+		.pool = pool,
+		.coroutine = NULL,
+		.prev = NULL,
+		.next = NULL,
+	};
+	pool_worker_push(&pool->live, worker);
+	pool->stats.workers += 1;
+
+	/* Work stays queued for existing workers if the pool can't grow */
+	routines_coroutine_t *coroutine;
+	if (routines_spawn_ex(&coroutine, pool_worker, worker) != 0) {
+		pool_worker_remove(&pool->live, worker);
+		pool->stats.workers -= 1;
+		object_free(&worker_slab, worker);
+		return false;
+	}
+
+	pool->stats.spawned += 1;
+	if (pool->stats.workers > pool->stats.peak_workers) {
+		pool->stats.peak_workers = pool->stats.workers;
+	}
+
+	return true;
+}
+
+static void pool_worker(void *arg) {
+	pool_worker_t *worker = arg;
+	routines_pool_t *pool = worker->pool;
+
+	/* The worker may retire before routines_spawn returns */
+	worker->coroutine = current_coroutine;
+
+	while (true) {
+		/*
+		 * Retire on an empty queue only while another worker is idle, so
+		 * that work arriving one piece at a time finds a parked worker
+		 * rather than spawning one each time
+		 */
+		bool idle = !pending_messages(pool->queue);
+		if (
+			idle
+			&& pool->stats.workers > pool->min_workers
+			&& pool->stats.idle > 0
+		) {
+			break;
 		}
-		if (reply_queue != NULL) {
-			*reply_queue = head->reply_queue;
+
+		pool->stats.idle += idle;
+		void *work = queue_recv(pool->queue, NULL);
+		pool->stats.idle -= idle;
+
+		if (work != NULL) {
+			pool->stats.pending -= 1;
+			pool->task(work);
+			pool->stats.completed += 1;
 		}
-		queue->head = head->next;
-		free(head);
 	}
 
-	if (queue->head == NULL) {
-		queue->tail = &queue->head;
-	}
+	/* Leave the control block for the pool to destroy */
+	pool_worker_remove(&pool->live, worker);
+	pool_worker_push(&pool->retired, worker);
+	pool->stats.workers -= 1;
+	pool->stats.retired += 1;
+}
 
-	return message;
+static void pool_reap(routines_pool_t *pool) {
+	assert(pool != NULL);
+
+	while (pool->retired != NULL) {
+		pool_worker_t *worker = pool->retired;
+		pool_worker_remove(&pool->retired, worker);
+		routines_destroy(worker->coroutine);
+		object_free(&worker_slab, worker);
+	}
 }
 
-static bool pending_messages(routines_queue_t *queue) {
-	return queue != NULL && queue->head != NULL;
+static void pool_worker_push(
+	pool_worker_t **list,
+	pool_worker_t *worker
+) {
+	assert(list != NULL);
+	assert(worker != NULL);
+	assert(worker->next == NULL);
+	assert(worker->prev == NULL);
+
+	worker->next = *list;
+	if (*list != NULL) {
+		(*list)->prev = worker;
+	}
+	*list = worker;
 }
 
-static void coroutine_enqueue(
-	coroutine_queue_t *queue,
-	routines_coroutine_t *coroutine
+static void pool_worker_remove(
+	pool_worker_t **list,
+	pool_worker_t *worker
 ) {
-	assert(queue != NULL);
-	assert(coroutine != NULL);
-	assert(coroutine->next == NULL);
-	assert(coroutine->prev == NULL);
-	assert(coroutine->queue == NULL);
+	assert(list != NULL);
+	assert(worker != NULL);
 
-	if (queue->tail != NULL) {
-		assert(queue->tail->next == NULL);
-		coroutine->prev = queue->tail;
-		queue->tail->next = coroutine;
+	if (worker->prev != NULL) {
+		worker->prev->next = worker->next;
 	} else {
-		assert(queue->head == NULL);
-		queue->head = coroutine;
+		assert(*list == worker);
+		*list = worker->next;
 	}
-	queue->tail = coroutine;
-	coroutine->queue = queue;
+
+	if (worker->next != NULL) {
+		worker->next->prev = worker->prev;
+	}
+
+	worker->next = NULL;
+	worker->prev = NULL;
 }
 
-static routines_coroutine_t *coroutine_dequeue(
-	coroutine_queue_t *queue
-) {
-	assert(queue != NULL);
-	routines_coroutine_t *head = queue->head;
+static size_t helpers_start(helper_pool_t *pool) {
+	pthread_mutex_lock(&pool->lock);
 
-	if (head != NULL) {
-		queue->head = head->next;
-		assert(head->queue == queue);
-		head->queue = NULL;
-		head->next = NULL;
-		if (queue->head != NULL) {
-			queue->head->prev = NULL;
+	if (!pool->started) {
+		pool->started = true;
+
+		long threads = pool->configured;
+		if (threads < 0) {
+			threads = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+		}
+
+		for (long t = 0; t < threads; t += 1) {
+			pthread_t thread;
+			if (pthread_create(&thread, NULL, helper_thread, pool) != 0) {
+				break;
+			}
+			pthread_detach(thread);
+			pool->threads += 1;
 		}
 	}
 
-	if (queue->head == NULL) {
-		queue->tail = NULL;
+	size_t threads = pool->threads;
+	pthread_mutex_unlock(&pool->lock);
+
+	return threads;
+}
+
+static void helpers_reset(helper_pool_t *pool) {
+	pool->head = NULL;
+	pool->tail = &pool->head;
+	pool->started = false;
+	pool->threads = 0;
+}
+
+static void *helper_thread(void *arg) {
+	helper_pool_t *pool = arg;
+
+	pthread_mutex_lock(&pool->lock);
+
+	while (true) {
+		while (pool->head == NULL) {
+			pthread_cond_wait(&pool->queued, &pool->lock);
+		}
+
+		helper_job_t *job = pool->head;
+		pool->head = job->next;
+		if (pool->head == NULL) {
+			pool->tail = &pool->head;
+		}
+		job->next = NULL;
+
+		/* A detached job may be gone as soon as it has run */
+		bool detached = job->detached;
+
+		pthread_mutex_unlock(&pool->lock);
+		job->run(job->arg);
+		pthread_mutex_lock(&pool->lock);
+
+		if (!detached) {
+			job->done = true;
+			pthread_cond_broadcast(&pool->done);
+		}
 	}
 
-	return head;
+	return NULL;
 }
 
-static void coroutine_remove(routines_coroutine_t *coroutine) {
-	assert(coroutine != NULL);
-	assert(coroutine->queue != NULL);
+static void helper_submit(helper_pool_t *pool, helper_job_t *job) {
+	assert(pool != NULL);
+	assert(job != NULL);
 
-	coroutine_queue_t *queue = coroutine->queue;
+	job->done = false;
+	job->next = NULL;
 
-	if (coroutine->prev != NULL) {
-		coroutine->prev->next = coroutine->next;
-	} else {
-		assert(queue->head == coroutine);
-		queue->head = coroutine->next;
+	pthread_mutex_lock(&pool->lock);
+	*pool->tail = job;
+	pool->tail = &job->next;
+	pthread_cond_signal(&pool->queued);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static void helper_finish(helper_pool_t *pool, helper_job_t *job) {
+	assert(pool != NULL);
+	assert(job != NULL);
+	assert(!job->detached);
+
+	pthread_mutex_lock(&pool->lock);
+
+	for (helper_job_t **queued = &pool->head; *queued != NULL;) {
+		if (*queued == job) {
+			*queued = job->next;
+			if (*queued == NULL) {
+				pool->tail = queued;
+			}
+			job->next = NULL;
+			job->done = true;
+			break;
+		}
+		queued = &(*queued)->next;
 	}
 
-	if (coroutine->next != NULL) {
-		coroutine->next->prev = coroutine->prev;
-	} else {
-		assert(queue->tail == coroutine);
-		queue->tail = coroutine->prev;
+	while (!job->done) {
+		pthread_cond_wait(&pool->done, &pool->lock);
 	}
 
-	coroutine->next = NULL;
-	coroutine->prev = NULL;
-	coroutine->queue = NULL;
+	pthread_mutex_unlock(&pool->lock);
 }
 
-static unsigned char *alloc_stack(void) {
-	unsigned char *stack = pop_stack();
+static ssize_t file_io(file_request_t *request) {
+	assert(request != NULL);
 
-	if (stack == NULL) {
-		stack = mmap(
-			NULL,
-			STACK_SIZE,
-			PROT_READ | PROT_WRITE,
-			MAP_PRIVATE | MAP_ANONYMOUS | MAP_GROWSDOWN | MAP_STACK,
-			0, 0
-		);
-		stack += STACK_SIZE;
+	routines_coroutine_t *self = current_coroutine;
+	routines_scheduler_t *scheduler = scheduler_self();
+
+	if (
+		self == NULL
+		|| scheduler == NULL
+		|| helpers_start(&io_helpers) == 0
+	) {
+		file_run(request);
+	} else {
+		request->job = (helper_job_t) {
+			.run = file_run,
+			.arg = request,
+			.detached = true,
+		};
+		request->coroutine = self;
+		request->scheduler = scheduler;
+
+		self->file_io = true;
+		file_pending += 1;
+		helper_submit(&io_helpers, &request->job);
+
+		/* The request is in use by the I/O thread until it completes */
+		while (!request->done) {
+			transfer(NULL, ROUTINES_BLOCKED_IO, NULL);
+		}
+		self->file_io = false;
 	}
-	return stack;
+
+	errno = request->error;
+	return request->result;
 }
 
-static void free_stack(unsigned char *stack_base) {
-	push_stack(stack_base);
+static void file_run(void *arg) {
+	file_request_t *request = arg;
+
+	ssize_t result;
+	do {
+		switch (request->operation) {
+		case FILE_PREAD:
+			result = pread(
+				request->fd,
+				request->buf,
+				request->count,
+				request->offset
+			);
+			break;
+		case FILE_PWRITE:
+			result = pwrite(
+				request->fd,
+				request->buf,
+				request->count,
+				request->offset
+			);
+			break;
+		case FILE_FSYNC:
+			result = fsync(request->fd);
+			break;
+		case FILE_FDATASYNC:
+			result = fdatasync(request->fd);
+			break;
+		case FILE_WRITE:
+			result = write(request->fd, request->buf, request->count);
+			break;
+		default:
+			result = -1;
+			errno = EINVAL;
+			break;
+		}
+	} while (result < 0 && errno == EINTR);
+
+	request->result = result;
+	request->error = result < 0 ? errno : 0;
+
+	file_complete(request);
 }
 
-static void push_stack(unsigned char *stack_base) {
-	stack_t *stack = malloc(sizeof(stack_t));
-	*stack = (stack_t) {
-		.stack_base = stack_base,
-		.next = unused_stacks,
-	};
-	unused_stacks = stack;
+static void file_complete(file_request_t *request) {
+	routines_scheduler_t *scheduler = request->scheduler;
+	if (scheduler == NULL) {
+		request->done = true;
+		return;
+	}
+
+	/* The request must not be touched once the scheduler can see it */
+	pthread_mutex_lock(&scheduler->lock);
+	request->next = scheduler->completed;
+	scheduler->completed = request;
+	atomic_store(&scheduler->completions, true);
+	if (scheduler->wake_fd >= 0) {
+		eventfd_write(scheduler->wake_fd, 1);
+	}
+	pthread_mutex_unlock(&scheduler->lock);
 }
 
-static unsigned char *pop_stack(void) {
-	unsigned char *stack_base = NULL;
-	stack_t *stack = unused_stacks;
+static void accept_completed(void) {
+	routines_scheduler_t *self = this_scheduler;
 
-	if (stack != NULL) {
-		stack_base = stack->stack_base;
-		unused_stacks = stack->next;
-		free(stack);
+	if (
+		self == NULL
+		|| !atomic_load_explicit(&self->completions, memory_order_relaxed)
+	) {
+		return;
 	}
 
-	return stack_base;
+	pthread_mutex_lock(&self->lock);
+	file_request_t *request = self->completed;
+	self->completed = NULL;
+	atomic_store(&self->completions, false);
+	pthread_mutex_unlock(&self->lock);
+
+	while (request != NULL) {
+		file_request_t *next = request->next;
+		routines_coroutine_t *coroutine = request->coroutine;
+
+		request->done = true;
+		file_pending -= 1;
+
+		/* A suspended co-routine sees the result once it is resumed */
+		if (coroutine->state == ROUTINES_BLOCKED_IO) {
+			coroutine->state = ROUTINES_RUNNING;
+			coroutine_enqueue(&ready_queue, coroutine);
+		}
+
+		request = next;
+	}
 }
 
-static void send(
-	routines_queue_t *send_queue,
-	void *message,
-	routines_coroutine_t *sender,
-	routines_queue_t *reply_queue
-) {
-	assert(send_queue != NULL);
+static void parallel_run(void *arg) {
+	parallel_t *loop = arg;
+
+	size_t chunk = atomic_fetch_add(&loop->next_chunk, 1);
+	while (chunk < loop->chunks) {
+		size_t begin = loop->begin + chunk * loop->grain;
+		size_t end = begin + loop->grain;
+		if (end > loop->end || end < begin) {
+			end = loop->end;
+		}
 
-	routines_coroutine_t *server =
-		coroutine_dequeue(&send_queue->recv_queue);
+		if (loop->results != NULL) {
+			loop->results[chunk] = loop->map(begin, end, loop->ctx);
+		} else if (loop->map != NULL) {
+			void *result = loop->map(begin, end, loop->ctx);
+			if (chunk > 0) {
+				result = loop->combine(loop->result, result, loop->ctx);
+			}
+			loop->result = result;
+		} else {
+			loop->fn(begin, end, loop->ctx);
+		}
 
-	if (server != NULL) {
-		enqueue_message(send_queue, message, NULL, reply_queue);
-		transfer(&ready_queue, ROUTINES_RUNNING, server);
-	} else {
-		enqueue_message(send_queue, message, sender, reply_queue);
+		chunk = atomic_fetch_add(&loop->next_chunk, 1);
 	}
 }
 
-static void *recv(
-	routines_queue_t *recv_queue,
-	routines_queue_t **reply_queue
-) {
-	assert(recv_queue != NULL);
+static void parallel_job(void *arg) {
+	parallel_t *loop = arg;
 
-	if (!pending_messages(recv_queue)) {
-		transfer(
-			&recv_queue->recv_queue,
-			ROUTINES_BLOCKED_RECV,
-			NULL
-		);
+	parallel_run(loop);
+
+	/* The caller may return as soon as the last job has finished */
+	if (atomic_fetch_sub(&loop->running, 1) == 1) {
+		file_complete(&loop->finished);
 	}
+}
 
-	return dequeue_message(recv_queue, reply_queue);
+static size_t parallel_jobs(parallel_t *loop) {
+	assert(loop != NULL);
+
+	size_t jobs = 0;
+	if (loop->chunks > 1) {
+		jobs = helpers_start(&helpers);
+		if (jobs > loop->chunks - 1) {
+			jobs = loop->chunks - 1;
+		}
+	}
+
+	return jobs;
+}
+
+static void parallel(parallel_t *loop, size_t jobs) {
+	assert(loop != NULL);
+
+	routines_coroutine_t *self = current_coroutine;
+	routines_scheduler_t *scheduler = self != NULL ? scheduler_self() : NULL;
+
+	helper_job_t *job = NULL;
+	if (jobs > 0) {
+		/* The loop runs on this thread alone if no jobs can be made */
+		job = malloc(jobs * sizeof(helper_job_t));
+		if (job == NULL) {
+			jobs = 0;
+		}
+	}
+
+	/* A co-routine leaves the loop to helper threads while it waits */
+	if (scheduler != NULL && jobs > 0) {
+		atomic_init(&loop->running, jobs);
+		loop->finished = (file_request_t) {
+			.coroutine = self,
+			.scheduler = scheduler,
+			.done = false,
+		};
+
+		self->file_io = true;
+		file_pending += 1;
+		for (size_t j = 0; j < jobs; j += 1) {
+			job[j] = (helper_job_t) {
+				.run = parallel_job,
+				.arg = loop,
+				.detached = true,
+			};
+			helper_submit(&helpers, &job[j]);
+		}
+
+		/* The loop is in use by helper threads until the last job finishes */
+		while (!loop->finished.done) {
+			transfer(NULL, ROUTINES_BLOCKED_IO, NULL);
+		}
+		self->file_io = false;
+
+		free(job);
+		return;
+	}
+
+	for (size_t j = 0; j < jobs; j += 1) {
+		job[j] = (helper_job_t) {
+			.run = parallel_run,
+			.arg = loop,
+		};
+		helper_submit(&helpers, &job[j]);
+	}
+
+	parallel_run(loop);
+
+	for (size_t j = 0; j < jobs; j += 1) {
+		helper_finish(&helpers, &job[j]);
+	}
+	free(job);
 }
 
 static void transfer(
@@ -633,6 +4790,9 @@ static void transfer(
 	}
 
 	if (coroutine == NULL) {
+		accept_migrated();
+		accept_completed();
+		wake_sleepers();
 		coroutine = coroutine_dequeue(&ready_queue);
 	}
 
@@ -655,28 +4815,59 @@ static void transfer(
 		}
     }
 
-	if (exited_coroutine != NULL) {
-		free_stack(exited_coroutine->stack_base);
-		exited_coroutine->stack_base = NULL;
-		exited_coroutine = NULL;
+	switched();
+}
+
+static void switched(void) {
+	routines_coroutine_t *exited = exited_coroutine;
+	if (exited == NULL) {
+		return;
+	}
+
+	exited_coroutine = NULL;
+	if (exited->detached) {
+		routines_destroy(exited);
+	} else {
+		free_stack(exited->stack_base);
+		exited->stack_base = NULL;
+	}
+}
+
+static void join_wake(routines_coroutine_t *coroutine) {
+	if (coroutine->scheduler == this_scheduler) {
+		routines_resume(coroutine);
+		return;
 	}
+
+	/* Joined after being migrated away from the joining thread */
+	assert(coroutine->queue == NULL);
+	coroutine->state = ROUTINES_RUNNING;
+	scheduler_enqueue(coroutine->scheduler, coroutine);
 }
 
 static void routine_entry(routines_coroutine_t *coroutine) {
 	current_coroutine = coroutine;
 	coroutine->state = ROUTINES_RUNNING;
-	coroutine->entrypoint(coroutine->arg);
+	if (coroutine->function != NULL) {
+		coroutine->result = coroutine->function(coroutine->arg);
+	} else {
+		coroutine->entrypoint(coroutine->arg);
+	}
 
 	coroutine_queue_t *join_queue = &coroutine->join_queue;
 	routines_coroutine_t *joined = coroutine_dequeue(join_queue);
 	while (joined != NULL) {
-		routines_resume(joined);
+		joined->join_result = coroutine->result;
+		join_wake(joined);
 		joined = coroutine_dequeue(join_queue);
 	}
 
 	exited_coroutine = coroutine;
 	coroutine->state = ROUTINES_COMPLETED;
 
+	accept_migrated();
+	accept_completed();
+	wake_sleepers();
 	current_coroutine = coroutine_dequeue(&ready_queue);
 	if (current_coroutine != NULL) {
 		longjmp(current_coroutine->context, 1);
@@ -6,6 +6,20 @@
  * Licence: MIT
  */
 
+#ifndef ROUTINES_H
+#define ROUTINES_H
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 typedef enum {
 	ROUTINES_COMPLETED,
 	ROUTINES_SUSPENDED,
@@ -13,20 +27,116 @@ typedef enum {
 	ROUTINES_BLOCKED_SEND,
 	ROUTINES_BLOCKED_RECV,
 	ROUTINES_BLOCKED_JOIN,
+	ROUTINES_BLOCKED_SLEEP,
+	ROUTINES_BLOCKED_IO,
 } routines_state_t;
 
+/* A resource with limited usage */
+typedef enum {
+	/* Live co-routines */
+	ROUTINES_LIMIT_COROUTINES,
+	/* Bytes of mapped stacks, including unused stacks */
+	ROUTINES_LIMIT_STACK_BYTES,
+	/* Messages waiting in queues */
+	ROUTINES_LIMIT_MESSAGES,
+	/* Number of limited resources */
+	ROUTINES_LIMITS,
+} routines_limit_t;
+
+/* A function called when usage of a resource exceeds its soft limit */
+typedef void (*routines_overload_t)(
+	routines_limit_t limit,
+	size_t usage,
+	void *ctx
+);
+
 /* A function that defines the work of a specific task */
 typedef void (*routines_task_t)(void *);
 
+/* A task returning a result to be collected by joining its co-routine */
+typedef void *(*routines_function_t)(void *);
+
+/* A function applied to the range of indices [begin, end) */
+typedef void (*routines_range_t)(size_t begin, size_t end, void *ctx);
+
+/* A function producing a partial result for the range [begin, end) */
+typedef void *(*routines_map_t)(size_t begin, size_t end, void *ctx);
+
+/* A function combining two partial results into one */
+typedef void *(*routines_combine_t)(void *left, void *right, void *ctx);
+
 /* A co-routine */
 typedef struct routines_coroutine routines_coroutine_t;
 
+/* A thread's co-routine scheduler */
+typedef struct routines_scheduler routines_scheduler_t;
+
 /* A message passing queue */
 typedef struct routines_queue routines_queue_t;
 
-/* Spawn a new co-routine as a separate task */
+/* A pool of worker co-routines sharing a work queue */
+typedef struct routines_pool routines_pool_t;
+
+/* A token bucket rate limiter */
+typedef struct routines_ratelimit routines_ratelimit_t;
+
+/* A pool of equal-sized I/O buffers */
+typedef struct routines_buffers routines_buffers_t;
+
+/* A source of process events delivered to a queue */
+typedef struct routines_source routines_source_t;
+
+/* A set of co-routines saved to or restored from a file */
+typedef struct routines_checkpoint routines_checkpoint_t;
+
+/* Datagram headers for recvmmsg and sendmmsg, defined with _GNU_SOURCE */
+struct mmsghdr;
+
+/*
+ * Spawn a new co-routine as a separate task
+ *
+ * Returns NULL if the co-routine or stack limit has been reached or if
+ * memory could not be allocated.
+ */
 routines_coroutine_t *routines_spawn(routines_task_t task, void *arg);
 
+/*
+ * Spawn a new co-routine as a separate task
+ *
+ * Returns 0 on success, EAGAIN if the co-routine or stack limit has
+ * been reached, or ENOMEM if memory could not be allocated.
+ */
+int routines_spawn_ex(
+	routines_coroutine_t **coroutine,
+	routines_task_t task,
+	void *arg
+);
+
+/*
+ * Spawn a new co-routine running a function whose result is returned
+ * when the co-routine is joined
+ *
+ * Returns NULL if the co-routine or stack limit has been reached or if
+ * memory could not be allocated.
+ */
+routines_coroutine_t *routines_spawn_function(
+	routines_function_t function,
+	void *arg
+);
+
+/*
+ * Spawn a new co-routine running a function whose result is returned
+ * when the co-routine is joined
+ *
+ * Returns 0 on success, EAGAIN if the co-routine or stack limit has
+ * been reached, or ENOMEM if memory could not be allocated.
+ */
+int routines_spawn_function_ex(
+	routines_coroutine_t **coroutine,
+	routines_function_t function,
+	void *arg
+);
+
 /*
  * Destroy a routine
  *
@@ -35,6 +145,14 @@ routines_coroutine_t *routines_spawn(routines_task_t task, void *arg);
  */
 void routines_destroy(routines_coroutine_t *coroutine);
 
+/*
+ * Destroy a routine as soon as it completes
+ *
+ * A routine that has already completed is destroyed immediately. A
+ * detached routine must not be joined, destroyed or detached again.
+ */
+void routines_detach(routines_coroutine_t *coroutine);
+
 /* Get the currently running routine */
 routines_coroutine_t *routines_self(void);
 
@@ -64,8 +182,23 @@ static inline void *routines_self_data(void) {
  */
 void routines_yield(void);
 
-/* Wait for a co-routine to complete */
-void routines_join(routines_coroutine_t *coroutine);
+/*
+ * Wait for a co-routine to complete
+ *
+ * Returns the result of a co-routine spawned with a function, or NULL
+ * for a task or if the co-routine is destroyed before completing.
+ * Returns straight away if the co-routine has already completed.
+ */
+void *routines_join(routines_coroutine_t *coroutine);
+
+/*
+ * Collect the result of a co-routine without blocking
+ *
+ * Stores the result as returned by routines_join in `result`, if it is
+ * not NULL, and returns 0 if the co-routine has completed. Returns
+ * EAGAIN otherwise.
+ */
+int routines_try_join(routines_coroutine_t *coroutine, void **result);
 
 /*
  * Suspend a running co-routine
@@ -90,13 +223,464 @@ static inline void routines_suspend_self(void) {
  */
 void routines_resume(routines_coroutine_t *coroutine);
 
+/*
+ * Timers
+ *
+ * Sleeping co-routines are made ready again as other co-routines are
+ * scheduled. When there are no co-routines left to run, the initial
+ * process thread should call routines_poll to wait until the next
+ * deadline.
+ */
+
+/* Get the time of the monotonic clock in nanoseconds */
+uint64_t routines_clock(void);
+
+/*
+ * Block the current co-routine until the clock reaches the deadline
+ *
+ * The co-routine may be woken early if it is suspended and resumed.
+ */
+void routines_sleep_until(uint64_t deadline);
+
+/* Block the current co-routine for a duration in nanoseconds */
+static inline void routines_sleep(uint64_t duration) {
+	routines_sleep_until(routines_clock() + duration);
+}
+
+/*
+ * Get the earliest deadline of any sleeping co-routine
+ *
+ * Returns false if no co-routines are sleeping.
+ */
+bool routines_next_deadline(uint64_t *deadline);
+
+/*
+ * File descriptor events
+ *
+ * Each thread has a reactor, started when first needed, that waits for
+ * events on file descriptors. Waiting co-routines are woken when the
+ * initial process thread calls routines_poll.
+ */
+
+/*
+ * Block the current co-routine until an epoll event is ready on a file
+ * descriptor
+ *
+ * The ready events are stored in `revents` if it is not NULL, which are
+ * none if the co-routine was suspended and resumed. Only one co-routine
+ * may wait on a file descriptor at a time. Returns 0 on success or an
+ * errno value if the file descriptor can't be waited on, such as EPERM
+ * for a regular file.
+ */
+int routines_wait_fd(int fd, uint32_t events, uint32_t *revents);
+
+/*
+ * Wait for the next deadline, file descriptor event or file operation and
+ * run every co-routine made ready
+ *
+ * This must be called from the initial process thread. Returns false,
+ * without waiting, if no co-routines are sleeping, waiting on a file
+ * descriptor or waiting for a file operation.
+ */
+bool routines_poll(void);
+
+/*
+ * Buffer pools
+ *
+ * Connections that are mostly idle need not each keep a buffer. A read
+ * from a pool waits for data to arrive before taking a buffer, which is
+ * released once the data has been handled, so buffer memory follows the
+ * traffic rather than the number of connections.
+ */
+
+/*
+ * Create a pool of buffers of at least `size` bytes
+ *
+ * At most `max` buffers are allocated at once, or any number if `max`
+ * is 0. Buffers are allocated when first needed and kept for reuse once
+ * released. Returns NULL if memory could not be allocated.
+ */
+routines_buffers_t *routines_buffers_create(size_t size, size_t max);
+
+/* Destroy a buffer pool once every buffer has been released */
+void routines_buffers_destroy(routines_buffers_t *pool);
+
+/*
+ * Take a buffer from a pool
+ *
+ * Blocks the current co-routine while `max` buffers are taken. Returns
+ * NULL with errno set if memory could not be allocated, or if the pool
+ * is exhausted when called from the initial task.
+ */
+void *routines_buffer_take(routines_buffers_t *pool);
+
+/* Return a buffer to its pool, waking a co-routine waiting for one */
+void routines_buffer_release(routines_buffers_t *pool, void *buffer);
+
+/*
+ * Free unused buffers of a pool beyond the first `keep`
+ *
+ * Returns the number of buffers freed.
+ */
+size_t routines_buffers_trim(routines_buffers_t *pool, size_t keep);
+
+/*
+ * Wait for a file descriptor to become readable then read into a buffer
+ * taken from a pool
+ *
+ * The buffer is stored in `buffer` and must be released to the pool once
+ * handled. Returns the bytes read, or 0 at end of file or -1 with errno
+ * set on failure, in which case no buffer is held.
+ */
+ssize_t routines_read_pooled(
+	int fd,
+	routines_buffers_t *pool,
+	void **buffer
+);
+
+/*
+ * Datagrams
+ *
+ * Batches of datagrams are moved with one system call, waiting in the
+ * reactor for the socket to become ready when it would block.
+ */
+
+/*
+ * Receive up to `max` datagrams with recvmmsg
+ *
+ * Blocks until at least one datagram is available, then returns every
+ * datagram already waiting up to `max`. Returns the number received, or
+ * -1 with errno set on failure.
+ */
+int routines_recv_datagrams(
+	int fd,
+	struct mmsghdr *msgs,
+	unsigned int max
+);
+
+/*
+ * Send `count` datagrams with sendmmsg
+ *
+ * Blocks until every datagram has been sent. Returns the number sent,
+ * which is less than `count` only if an error stopped the batch, or -1
+ * with errno set if none were sent.
+ */
+int routines_send_datagrams(
+	int fd,
+	struct mmsghdr *msgs,
+	unsigned int count
+);
+
+/*
+ * Send a buffer as consecutive datagrams of `segment` bytes
+ *
+ * Uses UDP generic segmentation offload to send up to 64 datagrams in
+ * one system call where supported, falling back to sendmmsg. The last
+ * datagram may be shorter. Returns the bytes sent, or -1 with errno set
+ * if none were sent.
+ */
+ssize_t routines_send_segments(
+	int fd,
+	const void *buf,
+	size_t len,
+	size_t segment,
+	const struct sockaddr *addr,
+	socklen_t addrlen
+);
+
+/*
+ * Event sources
+ *
+ * Signals, timers, event counters and child processes can be read by
+ * the reactor of the calling thread and delivered as messages to a queue
+ * with routines_signal. Each source is read by its own co-routine, and
+ * events are dropped while the message limit is reached.
+ */
+
+/*
+ * Deliver a Unix signal to a queue
+ *
+ * The signal is blocked in the calling thread, and should be blocked in
+ * every other thread, so that it is only seen by the source. Each
+ * message is the signal number. Returns NULL with errno set on failure.
+ */
+routines_source_t *routines_source_signal(
+	routines_queue_t *queue,
+	int signo
+);
+
+/*
+ * Deliver a message every `interval` nanoseconds to a queue
+ *
+ * Each message is the number of intervals elapsed since the last one.
+ * Returns NULL with errno set on failure.
+ */
+routines_source_t *routines_source_timer(
+	routines_queue_t *queue,
+	uint64_t interval
+);
+
+/*
+ * Create an event counter that delivers its count to a queue
+ *
+ * The counter is an eventfd, found with routines_source_fd, to which any
+ * thread or process may write. Each message is the total written since
+ * the last one. Returns NULL with errno set on failure.
+ */
+routines_source_t *routines_source_event(routines_queue_t *queue);
+
+/*
+ * Deliver the exit of a child process to a queue
+ *
+ * The child is reaped and one message is sent, holding its status as
+ * reported by waitpid. A successful exit is therefore a NULL message.
+ * Returns NULL with errno set on failure.
+ */
+routines_source_t *routines_source_child(
+	routines_queue_t *queue,
+	pid_t pid
+);
+
+/* Get the file descriptor read by a source */
+int routines_source_fd(routines_source_t *source);
+
+/* Stop a source and close its file descriptor */
+void routines_source_destroy(routines_source_t *source);
+
+/*
+ * File I/O
+ *
+ * Reads and writes of regular files always block, so co-routines hand
+ * them to a pool of I/O threads and are woken through the reactor once
+ * they complete. Operations run synchronously when called from the
+ * initial task or when no I/O threads are available.
+ */
+
+/*
+ * Read from a file at an offset as with pread
+ *
+ * A co-routine waiting for a file operation can't be destroyed or
+ * migrated. Returns the bytes read, or -1 with errno set on failure.
+ */
+ssize_t routines_pread(int fd, void *buf, size_t count, off_t offset);
+
+/*
+ * Write to a file at an offset as with pwrite
+ *
+ * Returns the bytes written, or -1 with errno set on failure.
+ */
+ssize_t routines_pwrite(
+	int fd,
+	const void *buf,
+	size_t count,
+	off_t offset
+);
+
+/* Flush a file to storage as with fsync */
+int routines_fsync(int fd);
+
+/* Flush the data of a file to storage as with fdatasync */
+int routines_fdatasync(int fd);
+
+/*
+ * Allocate a buffer aligned to a page for use with O_DIRECT
+ *
+ * The size is rounded up to a whole number of pages. Returns NULL with
+ * errno set on failure.
+ */
+void *routines_io_buffer_alloc(size_t size);
+
+/* Free a buffer allocated with routines_io_buffer_alloc */
+void routines_io_buffer_free(void *buffer);
+
+/*
+ * Logging
+ *
+ * Records are formatted into a buffer of the calling thread and written
+ * in batches by a co-routine, on an I/O thread where available, so that
+ * logging never waits for a write unless both of the thread's buffers
+ * are full. Records of a thread are written in order, but records of
+ * different threads may interleave by batch.
+ */
+
+/*
+ * Set where and when log records are written
+ *
+ * Records are written to `fd` once `batch` bytes are waiting or the
+ * oldest has waited `interval` nanoseconds. Defaults to standard error,
+ * half a buffer and 10ms. Applies to every thread.
+ */
+void routines_log_config(int fd, size_t batch, uint64_t interval);
+
+/*
+ * Append a formatted record to the log of the calling thread
+ *
+ * Nothing is added to the record, such as a newline. A record longer
+ * than a log buffer is truncated.
+ */
+void routines_log(const char *format, ...)
+	__attribute__((format(printf, 1, 2)));
+
+/* Append a formatted record with a list of arguments */
+void routines_vlog(const char *format, va_list args)
+	__attribute__((format(printf, 1, 0)));
+
+/*
+ * Write every log record of the calling thread
+ *
+ * Records waiting when a thread or the process exits are written
+ * without needing a flush.
+ */
+void routines_log_flush(void);
+
+/*
+ * Memory pressure
+ *
+ * Stacks of completed co-routines are kept by each thread for reuse.
+ * They can be released when memory is scarce, either directly or
+ * whenever the kernel reports memory pressure.
+ */
+
+/*
+ * Release unused stacks of the calling thread beyond the first `keep`
+ *
+ * Freed heap memory is also returned to the system where supported.
+ * Returns the number of stacks released.
+ */
+size_t routines_trim(size_t keep);
+
+/*
+ * Count the unused stacks kept by the calling thread, including stacks
+ * mapped in a chunk but not yet used
+ */
+size_t routines_unused_stacks(void);
+
+/*
+ * Release all unused stacks of the calling thread whenever its reactor
+ * sees memory pressure
+ *
+ * `path` names a PSI file such as a cgroup's memory.pressure, or NULL
+ * for /proc/pressure/memory. Pressure is reported when tasks stall for
+ * `stall` nanoseconds in any `window` nanoseconds, where the kernel
+ * requires unprivileged processes to use a multiple of two seconds for
+ * the window. Replaces any existing watch. Returns 0 on success or an
+ * errno value on failure.
+ */
+int routines_pressure_watch(
+	const char *path,
+	uint64_t stall,
+	uint64_t window
+);
+
+/* Stop watching for memory pressure */
+void routines_pressure_unwatch(void);
+
+/*
+ * Admission control
+ *
+ * Each limited resource has a soft and a hard limit, where 0 is
+ * unlimited. Usage is counted across all threads. Once usage exceeds a
+ * soft limit the overload handler is called so that load can be shed
+ * early. Requests that would exceed a hard limit fail straight away.
+ * Limits and the handler may be changed from any thread at any time.
+ */
+
+/* Set the soft and hard limits of a resource */
+void routines_limit_set(routines_limit_t limit, size_t soft, size_t hard);
+
+/* Get the current usage of a resource */
+size_t routines_limit_usage(routines_limit_t limit);
+
+/*
+ * Set the function called when usage rises above a soft limit
+ *
+ * The handler is called from the operation that raised the usage and
+ * must not itself spawn co-routines or send messages.
+ */
+void routines_overload_set(routines_overload_t handler, void *ctx);
+
+/*
+ * Scheduler threads
+ *
+ * Each thread schedules its own co-routines, which should only be used
+ * from that thread. A co-routine that is not blocked can be migrated to
+ * run on another thread.
+ */
+
+/*
+ * Get the scheduler of the calling thread
+ *
+ * Returns NULL if the scheduler could not be allocated.
+ */
+routines_scheduler_t *routines_scheduler(void);
+
+/* Get the number of co-routines owned by a scheduler */
+size_t routines_scheduler_load(routines_scheduler_t *scheduler);
+
+/*
+ * Move a ready or suspended co-routine to another scheduler
+ *
+ * The co-routine must belong to the calling thread and must not be the
+ * current co-routine. It keeps its state and is added to the ready
+ * queue of the other scheduler when that scheduler next picks a
+ * co-routine to run. The other thread must outlive the call. Co-routines
+ * waiting to join it are woken on the threads that own them.
+ */
+void routines_migrate(
+	routines_coroutine_t *coroutine,
+	routines_scheduler_t *scheduler
+);
+
+/*
+ * Migrate ready co-routines to the least loaded scheduler until both
+ * schedulers own a similar number of co-routines
+ *
+ * Returns the number of co-routines migrated.
+ */
+size_t routines_rebalance(void);
+
+/*
+ * Forking
+ *
+ * A forked child inherits copies of every co-routine along with the
+ * ready and sleeping queues of the parent.
+ */
+
+/*
+ * Reset the scheduler in the child of a fork
+ *
+ * Every co-routine that was ready or sleeping is suspended so that it
+ * only runs again if the child resumes it. Helper threads are restarted
+ * when next needed. The pool of unused stacks is kept if `keep_stacks`
+ * is set, otherwise it is unmapped.
+ */
+void routines_fork_child(bool keep_stacks);
+
+/*
+ * Reset the scheduler automatically in the child of every fork
+ *
+ * Calling this again changes whether unused stacks are kept.
+ */
+void routines_atfork(bool keep_stacks);
+
 /*
  * Synchronisation and communication primitives
  */
 
-/* Create a new messaging queue */
+/*
+ * Create a new messaging queue
+ *
+ * Returns NULL if memory could not be allocated.
+ */
 routines_queue_t *routines_queue_create(void);
 
+/*
+ * Create a new messaging queue
+ *
+ * Returns 0 on success or ENOMEM if memory could not be allocated.
+ */
+int routines_queue_create_ex(routines_queue_t **queue);
+
 /*
  * Destroy a messaging queue
  *
@@ -105,8 +689,21 @@ routines_queue_t *routines_queue_create(void);
  */
 void routines_queue_destroy(routines_queue_t *queue);
 
-/* Send a message to a queue, blocking until the message is received */
-void routines_send(routines_queue_t *queue, void *message);
+/*
+ * Send a message to a queue, blocking until the message is received
+ *
+ * Returns 0 on success, or EAGAIN if the message limit has been reached
+ * or ENOMEM if the message could not be queued, both without blocking.
+ */
+int routines_send(routines_queue_t *queue, void *message);
+
+/*
+ * Send a message to a queue only if a co-routine is waiting to receive
+ * it, without blocking or switching to the receiver
+ *
+ * Returns 0 on success or EAGAIN if no receiver is waiting.
+ */
+int routines_try_send(routines_queue_t *queue, void *message);
 
 /*
  * Receive a message from a queue, blocking until a message is
@@ -114,8 +711,13 @@ void routines_send(routines_queue_t *queue, void *message);
  */
 void *routines_wait(routines_queue_t *queue);
 
-/* Send a message to a queue without blocking */
-void routines_signal(routines_queue_t *queue, void *message);
+/*
+ * Send a message to a queue without blocking
+ *
+ * Returns 0 on success, EAGAIN if the message limit has been reached,
+ * or ENOMEM if the message could not be queued.
+ */
+int routines_signal(routines_queue_t *queue, void *message);
 
 /*
  * Receive a message from a queue without blocking
@@ -124,13 +726,47 @@ void routines_signal(routines_queue_t *queue, void *message);
  */
 void *routines_read(routines_queue_t *queue);
 
-/* Send a message to another queue and wait for a reply */
+/*
+ * Send a message to another queue and wait for a reply
+ *
+ * If the receiver is already waiting, the message is handed to it
+ * directly and its reply is handed straight back, without queueing
+ * either. Returns NULL, without blocking, if the message could not be
+ * queued.
+ */
 void *routines_call(
 	routines_queue_t *send_queue,
 	void *message,
 	routines_queue_t *reply_queue
 );
 
+/*
+ * Send a message to another queue and wait for a reply
+ *
+ * Returns 0 on success, or EAGAIN if the message limit has been reached
+ * or ENOMEM if the message could not be queued, both without blocking.
+ */
+int routines_call_ex(
+	routines_queue_t *send_queue,
+	void *message,
+	routines_queue_t *reply_queue,
+	void **reply
+);
+
+/*
+ * Send a message to another queue and wait for a reply, only if a
+ * co-routine is already waiting to receive the message
+ *
+ * Returns 0 on success, EAGAIN, without blocking, if no receiver is
+ * waiting, or ENOMEM if the message could not be queued.
+ */
+int routines_try_call(
+	routines_queue_t *send_queue,
+	void *message,
+	routines_queue_t *reply_queue,
+	void **reply
+);
+
 /*
  * Receive a message from a message queue along with a message queue
  * on which the caller is waiting for a reply
@@ -143,9 +779,224 @@ void *routines_recv(
 /*
  * Send a message to another queue without blocking, providing another
  * queue for a later reply
+ *
+ * Returns 0 on success, EAGAIN if the message limit has been reached,
+ * or ENOMEM if the message could not be queued.
  */
-void routines_post(
+int routines_post(
 	routines_queue_t *send_queue,
 	void *message,
 	routines_queue_t *reply_queue
 );
+
+/*
+ * Worker pools
+ */
+
+/* Utilisation statistics for a worker pool */
+typedef struct {
+	/* Workers currently alive */
+	size_t workers;
+	/* Workers waiting for work */
+	size_t idle;
+	/* Work submitted but not yet taken by a worker */
+	size_t pending;
+	/* Most workers alive at any one time */
+	size_t peak_workers;
+	/* Workers spawned over the life of the pool */
+	size_t spawned;
+	/* Workers retired over the life of the pool */
+	size_t retired;
+	/* Work completed over the life of the pool */
+	size_t completed;
+} routines_pool_stats_t;
+
+/*
+ * Create a pool of workers that each call `task` with submitted work
+ *
+ * At least `min_workers` workers are kept alive. More workers are
+ * spawned, up to `max_workers`, while work is waiting for a worker and
+ * retire again once the queue has been drained, leaving at least one
+ * idle worker. Returns NULL if memory could not be allocated or the
+ * minimum workers could not be spawned.
+ */
+routines_pool_t *routines_pool_create(
+	routines_task_t task,
+	size_t min_workers,
+	size_t max_workers
+);
+
+/*
+ * Destroy a worker pool
+ *
+ * All workers are destroyed and any work not yet taken is lost. This
+ * must not be called from one of the pool's own workers.
+ */
+void routines_pool_destroy(routines_pool_t *pool);
+
+/*
+ * Submit work to a pool without blocking
+ *
+ * The work must not be NULL. Returns 0 on success, EAGAIN if the message
+ * limit has been reached, or ENOMEM if the work could not be queued.
+ */
+int routines_pool_submit(routines_pool_t *pool, void *work);
+
+/* Get the current utilisation statistics of a pool */
+void routines_pool_stats(
+	routines_pool_t *pool,
+	routines_pool_stats_t *stats
+);
+
+/*
+ * Parallel loops
+ *
+ * The range is split into chunks of `grain` indices which are run by
+ * the calling thread and a set of helper threads, one per additional
+ * processor. Chunks are handed out one at a time so that faster
+ * threads take on more of the range. The call returns once every
+ * chunk has completed.
+ *
+ * Chunk functions are run on other threads and so must not use any of
+ * the co-routine or message passing operations.
+ */
+
+/* Call `fn` for each chunk of the range [begin, end) */
+void routines_parallel_for(
+	size_t begin,
+	size_t end,
+	size_t grain,
+	routines_range_t fn,
+	void *ctx
+);
+
+/*
+ * Call `map` for each chunk of the range [begin, end) and combine the
+ * results in order with `combine`
+ *
+ * Returns NULL for an empty range.
+ */
+void *routines_parallel_reduce(
+	size_t begin,
+	size_t end,
+	size_t grain,
+	routines_map_t map,
+	routines_combine_t combine,
+	void *ctx
+);
+
+/*
+ * Rate limiting
+ */
+
+/*
+ * Create a token bucket that gains `rate` tokens per second and holds
+ * at most `burst` tokens
+ *
+ * The bucket starts full. Returns NULL if memory could not be allocated.
+ */
+routines_ratelimit_t *routines_ratelimit_create(
+	uint64_t rate,
+	uint64_t burst
+);
+
+/* Destroy a token bucket */
+void routines_ratelimit_destroy(routines_ratelimit_t *limit);
+
+/*
+ * Take tokens from a bucket, sleeping until they become available
+ *
+ * Tokens are handed out in the order they are requested. At most
+ * `burst` tokens may be taken at once.
+ */
+void routines_ratelimit_acquire(
+	routines_ratelimit_t *limit,
+	uint64_t tokens
+);
+
+/*
+ * Take tokens from a bucket without blocking
+ *
+ * Returns false, taking no tokens, if not enough tokens are available.
+ */
+bool routines_ratelimit_try_acquire(
+	routines_ratelimit_t *limit,
+	uint64_t tokens
+);
+
+/*
+ * Checkpoints (experimental)
+ *
+ * A checkpoint saves a set of suspended co-routines to a file so that a
+ * later run of the same program can restart them. Each co-routine is
+ * saved as its task along with a number of bytes of the argument it was
+ * spawned with. On restore, each task is started again from the
+ * beginning with a pointer to its saved argument, so any progress to be
+ * kept must be recorded in the argument and it must not hold pointers.
+ */
+
+/*
+ * Create an empty checkpoint
+ *
+ * Returns NULL if memory could not be allocated.
+ */
+routines_checkpoint_t *routines_checkpoint_create(void);
+
+/*
+ * Add a suspended co-routine to a checkpoint, saving `size` bytes of
+ * the argument it was spawned with
+ *
+ * The co-routine must have been spawned with a task, not a function.
+ *
+ * Returns 0 on success or ENOMEM if the checkpoint could not grow.
+ */
+int routines_checkpoint_add(
+	routines_checkpoint_t *checkpoint,
+	routines_coroutine_t *coroutine,
+	size_t size
+);
+
+/*
+ * Save a checkpoint to a file, replacing it atomically
+ *
+ * Returns 0 on success or an errno value on failure.
+ */
+int routines_checkpoint_save(
+	routines_checkpoint_t *checkpoint,
+	const char *path
+);
+
+/*
+ * Restore the co-routines saved to a file
+ *
+ * The file is mapped privately and each co-routine is spawned with a
+ * pointer to its argument in the mapping. Returns NULL and sets errno
+ * if the file cannot be read, was saved by a different program, or the
+ * co-routines could not all be spawned, in which case any that were
+ * started are destroyed. ENOEXEC means a task's object is a different
+ * build from the one that saved it.
+ */
+routines_checkpoint_t *routines_checkpoint_restore(const char *path);
+
+/* Get the number of co-routines in a checkpoint */
+size_t routines_checkpoint_count(routines_checkpoint_t *checkpoint);
+
+/* Get a co-routine from a checkpoint */
+routines_coroutine_t *routines_checkpoint_coroutine(
+	routines_checkpoint_t *checkpoint,
+	size_t index
+);
+
+/*
+ * Destroy a checkpoint
+ *
+ * The co-routines are not destroyed, but restored co-routines must be
+ * destroyed first as their arguments are unmapped.
+ */
+void routines_checkpoint_destroy(routines_checkpoint_t *checkpoint);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ROUTINES_H */
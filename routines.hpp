@@ -0,0 +1,566 @@
+/*
+ * C++ interface to the simple co-routine library
+ *
+ * Author:  Curtis Millar
+ * Date:    11 October 2019
+ * Licence: MIT
+ */
+
+#ifndef ROUTINES_HPP
+#define ROUTINES_HPP
+
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <new>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+
+#if __cplusplus >= 202002L && __has_include(<coroutine>)
+#include <coroutine>
+#define ROUTINES_HAVE_COROUTINES 1
+#endif
+
+#include <routines.h>
+
+namespace routines {
+
+/* Thrown when a value is received but no message was sent */
+struct no_message : std::exception {
+	const char *what() const noexcept override {
+		return "routines: received no message";
+	}
+};
+
+namespace detail {
+
+/* A callable boxed so that it can be passed through a task argument */
+struct task_base {
+	/* Exception that escaped the callable */
+	std::exception_ptr error;
+
+	virtual ~task_base() = default;
+	virtual void run() = 0;
+
+	/*
+	 * Entrypoint passed to routines_spawn
+	 *
+	 * Exceptions cannot unwind past the start of a co-routine stack so
+	 * they are caught here and kept to be rethrown on join. Tasks passed
+	 * straight to the C interface have no such wrapper, and an exception
+	 * escaping them calls std::terminate.
+	 */
+	static void entry(void *arg) noexcept {
+		auto *self = static_cast<task_base *>(arg);
+		try {
+			self->run();
+		} catch (...) {
+			self->error = std::current_exception();
+		}
+	}
+};
+
+/* A C task and its argument */
+struct c_task final : task_base {
+	routines_task_t fn;
+	void *arg;
+
+	c_task(routines_task_t fn, void *arg) : fn(fn), arg(arg) {}
+
+	void run() override {
+		fn(arg);
+	}
+};
+
+template <typename F>
+struct task final : task_base {
+	F fn;
+
+	template <typename G>
+	explicit task(G &&fn) : fn(std::forward<G>(fn)) {}
+
+	void run() override {
+		fn();
+	}
+};
+
+/* Throw the exception matching an error from sending a message */
+[[noreturn]] inline void throw_error(int error) {
+	if (error == ENOMEM) {
+		throw std::bad_alloc();
+	}
+	throw std::system_error(error, std::generic_category(), "routines");
+}
+
+/*
+ * Storage for messages of type T that are not passed in place
+ *
+ * Each thread keeps a short free list of slots, so that once values are
+ * flowing, sending one takes a slot freed by an earlier receive rather
+ * than allocating. A slot may be freed on a different thread than the
+ * one that took it.
+ */
+template <typename T>
+class slots {
+public:
+	/* Throws std::bad_alloc if a slot could not be allocated */
+	static void *take() {
+		slots &cache = local();
+		slot *taken = cache.free_;
+		if (taken == nullptr) {
+			return ::operator new(
+				sizeof(slot),
+				std::align_val_t(alignof(slot))
+			);
+		}
+		cache.free_ = taken->next;
+		cache.count_ -= 1;
+		return taken;
+	}
+
+	static void give(void *storage) noexcept {
+		slots &cache = local();
+		if (cache.count_ >= capacity) {
+			::operator delete(storage, std::align_val_t(alignof(slot)));
+			return;
+		}
+		auto *given = static_cast<slot *>(storage);
+		given->next = cache.free_;
+		cache.free_ = given;
+		cache.count_ += 1;
+	}
+
+	~slots() {
+		while (free_ != nullptr) {
+			::operator delete(
+				std::exchange(free_, free_->next),
+				std::align_val_t(alignof(slot))
+			);
+		}
+	}
+
+private:
+	union slot {
+		slot *next;
+		alignas(T) unsigned char value[sizeof(T)];
+	};
+
+	/* Free slots kept by each thread */
+	static constexpr std::size_t capacity = 64;
+
+	static slots &local() noexcept {
+		static thread_local slots cache;
+		return cache;
+	}
+
+	slot *free_ = nullptr;
+	std::size_t count_ = 0;
+};
+
+/*
+ * Messages that fit in a pointer and can be copied bytewise are passed
+ * in place of the pointer, anything else is moved into a slot
+ */
+template <typename T>
+inline constexpr bool is_inline_message
+	= std::is_trivially_copyable_v<T> && sizeof(T) <= sizeof(void *);
+
+template <typename T, typename U>
+inline void *encode(U &&value) {
+	if constexpr (is_inline_message<T>) {
+		T copy(std::forward<U>(value));
+		void *message = nullptr;
+		std::memcpy(&message, &copy, sizeof(T));
+		return message;
+	} else {
+		void *storage = slots<T>::take();
+		try {
+			return ::new (storage) T(std::forward<U>(value));
+		} catch (...) {
+			slots<T>::give(storage);
+			throw;
+		}
+	}
+}
+
+/*
+ * Slots are never NULL, so a NULL message means a receiver was woken
+ * without one having been sent
+ */
+template <typename T>
+inline T decode(void *message) {
+	if constexpr (is_inline_message<T>) {
+		T value;
+		std::memcpy(&value, &message, sizeof(T));
+		return value;
+	} else {
+		if (message == nullptr) {
+			throw no_message();
+		}
+		T *stored = std::launder(static_cast<T *>(message));
+		struct release {
+			T *stored;
+			~release() {
+				stored->~T();
+				slots<T>::give(stored);
+			}
+		} guard{stored};
+		return std::move(*stored);
+	}
+}
+
+/* Release a message that will never be decoded */
+template <typename T>
+inline void discard(void *message) {
+	if constexpr (!is_inline_message<T>) {
+		T *stored = std::launder(static_cast<T *>(message));
+		stored->~T();
+		slots<T>::give(stored);
+	}
+}
+
+} /* namespace detail */
+
+/* An owned co-routine, destroyed along with the handle */
+class Coroutine {
+public:
+	Coroutine() noexcept = default;
+
+	/* Take ownership of an existing co-routine */
+	explicit Coroutine(routines_coroutine_t *handle) noexcept
+		: handle_(handle) {}
+
+	/* Spawn a co-routine running a C task */
+	Coroutine(routines_task_t task, void *arg) {
+		start(std::make_unique<detail::c_task>(task, arg));
+	}
+
+	Coroutine(Coroutine &&other) noexcept
+		: handle_(std::exchange(other.handle_, nullptr)),
+		  task_(std::move(other.task_)) {}
+
+	Coroutine &operator=(Coroutine &&other) noexcept {
+		if (this != &other) {
+			reset();
+			handle_ = std::exchange(other.handle_, nullptr);
+			task_ = std::move(other.task_);
+		}
+		return *this;
+	}
+
+	Coroutine(const Coroutine &) = delete;
+	Coroutine &operator=(const Coroutine &) = delete;
+
+	~Coroutine() {
+		reset();
+	}
+
+	/*
+	 * Spawn a co-routine running a callable
+	 *
+	 * An exception thrown by the callable ends the co-routine and is
+	 * rethrown by `join`.
+	 */
+	template <typename F>
+	static Coroutine spawn(F &&fn) {
+		Coroutine coroutine;
+		coroutine.start(std::make_unique<detail::task<std::decay_t<F>>>(
+			std::forward<F>(fn)
+		));
+		return coroutine;
+	}
+
+	/* Destroy the owned co-routine, if any */
+	void reset() noexcept {
+		if (handle_ != nullptr) {
+			routines_destroy(handle_);
+			handle_ = nullptr;
+		}
+		task_.reset();
+	}
+
+	/* Give up ownership of an adopted co-routine */
+	routines_coroutine_t *release() noexcept {
+		return task_ == nullptr ? std::exchange(handle_, nullptr) : nullptr;
+	}
+
+	routines_coroutine_t *get() const noexcept {
+		return handle_;
+	}
+
+	explicit operator bool() const noexcept {
+		return handle_ != nullptr;
+	}
+
+	routines_state_t state() const {
+		return routines_state(handle_);
+	}
+
+	/*
+	 * Wait for the co-routine to complete
+	 *
+	 * Rethrows any exception that escaped the co-routine's task.
+	 */
+	void join() {
+		routines_join(handle_);
+		if (task_ != nullptr && task_->error != nullptr) {
+			std::rethrow_exception(std::exchange(task_->error, nullptr));
+		}
+	}
+
+	/*
+	 * Check whether the co-routine has completed without blocking
+	 *
+	 * Rethrows any exception that escaped the co-routine's task once it
+	 * has completed.
+	 */
+	bool try_join() {
+		if (routines_try_join(handle_, nullptr) != 0) {
+			return false;
+		}
+		if (task_ != nullptr && task_->error != nullptr) {
+			std::rethrow_exception(std::exchange(task_->error, nullptr));
+		}
+		return true;
+	}
+
+	void suspend() {
+		routines_suspend(handle_);
+	}
+
+	void resume() {
+		routines_resume(handle_);
+	}
+
+private:
+	/* Leaves the handle empty if a limit has been reached */
+	void start(std::unique_ptr<detail::task_base> task) {
+		task_ = std::move(task);
+		int error = routines_spawn_ex(
+			&handle_,
+			detail::task_base::entry,
+			task_.get()
+		);
+		if (error == ENOMEM) {
+			throw std::bad_alloc();
+		}
+	}
+
+	routines_coroutine_t *handle_ = nullptr;
+	std::unique_ptr<detail::task_base> task_;
+};
+
+/* An owned message queue carrying values of type T */
+template <typename T>
+class Queue {
+public:
+	Queue() {
+		int error = routines_queue_create_ex(&handle_);
+		if (error != 0) {
+			detail::throw_error(error);
+		}
+	}
+
+	Queue(Queue &&other) noexcept
+		: handle_(std::exchange(other.handle_, nullptr)) {}
+
+	Queue &operator=(Queue &&other) noexcept {
+		if (this != &other) {
+			reset();
+			handle_ = std::exchange(other.handle_, nullptr);
+		}
+		return *this;
+	}
+
+	Queue(const Queue &) = delete;
+	Queue &operator=(const Queue &) = delete;
+
+	~Queue() {
+		reset();
+	}
+
+	/* Destroy the owned queue, if any */
+	void reset() noexcept {
+		if (handle_ != nullptr) {
+			if constexpr (!detail::is_inline_message<T>) {
+				void *message = routines_read(handle_);
+				while (message != nullptr) {
+					detail::discard<T>(message);
+					message = routines_read(handle_);
+				}
+			}
+			routines_queue_destroy(handle_);
+			handle_ = nullptr;
+		}
+	}
+
+	routines_queue_t *get() const noexcept {
+		return handle_;
+	}
+
+	/*
+	 * Send a value, blocking until it is received
+	 *
+	 * Throws, without blocking, std::bad_alloc if the value could not be
+	 * queued or std::system_error with EAGAIN if the message limit has
+	 * been reached.
+	 */
+	template <typename U = T>
+	void send(U &&value) {
+		void *message = detail::encode<T>(std::forward<U>(value));
+		int error = routines_send(handle_, message);
+		if (error != 0) {
+			detail::discard<T>(message);
+			detail::throw_error(error);
+		}
+	}
+
+	/*
+	 * Send a value without blocking
+	 *
+	 * Returns EAGAIN or ENOMEM, dropping the value, if the message limit
+	 * has been reached or the value could not be queued.
+	 */
+	template <typename U = T>
+	int signal(U &&value) {
+		void *message = detail::encode<T>(std::forward<U>(value));
+		int error = routines_signal(handle_, message);
+		if (error != 0) {
+			detail::discard<T>(message);
+		}
+		return error;
+	}
+
+	/*
+	 * Send a value only if a receiver is waiting, without blocking
+	 *
+	 * Returns EAGAIN, dropping the value, if no receiver is waiting.
+	 */
+	template <typename U = T>
+	int try_send(U &&value) {
+		void *message = detail::encode<T>(std::forward<U>(value));
+		int error = routines_try_send(handle_, message);
+		if (error != 0) {
+			detail::discard<T>(message);
+		}
+		return error;
+	}
+
+	/* Receive a value, blocking until one is available */
+	T wait() {
+		return detail::decode<T>(routines_wait(handle_));
+	}
+
+	/*
+	 * Send a value and wait for a reply on another queue
+	 *
+	 * Throws, without blocking, std::bad_alloc if the value could not be
+	 * queued or std::system_error with EAGAIN if the message limit has
+	 * been reached.
+	 */
+	template <typename R, typename U = T>
+	R call(U &&value, Queue<R> &reply) {
+		void *message = detail::encode<T>(std::forward<U>(value));
+		void *result = nullptr;
+		int error = routines_call_ex(handle_, message, reply.get(), &result);
+		if (error != 0) {
+			detail::discard<T>(message);
+			detail::throw_error(error);
+		}
+		return detail::decode<R>(result);
+	}
+
+	/*
+	 * Send a value without blocking, naming a queue for the reply
+	 *
+	 * Returns EAGAIN or ENOMEM, dropping the value, if the message limit
+	 * has been reached or the value could not be queued.
+	 */
+	template <typename R, typename U = T>
+	int post(U &&value, Queue<R> &reply) {
+		void *message = detail::encode<T>(std::forward<U>(value));
+		int error = routines_post(handle_, message, reply.get());
+		if (error != 0) {
+			detail::discard<T>(message);
+		}
+		return error;
+	}
+
+	/*
+	 * Receive a value along with the queue on which the caller is
+	 * waiting for a reply
+	 */
+	T recv(routines_queue_t *&reply) {
+		return detail::decode<T>(routines_recv(handle_, &reply));
+	}
+
+#ifdef ROUTINES_HAVE_COROUTINES
+	/*
+	 * Wait for a value from a C++ coroutine
+	 *
+	 * The waiting is done by a co-routine which resumes the awaiting
+	 * coroutine on its own stack once a value arrives.
+	 */
+	class awaiter {
+	public:
+		explicit awaiter(Queue &queue) noexcept : queue_(queue) {}
+
+		bool await_ready() const noexcept {
+			return false;
+		}
+
+		/*
+		 * Throws std::bad_alloc, leaving the coroutine to resume with
+		 * it, if no co-routine could be spawned to wait
+		 */
+		void await_suspend(std::coroutine_handle<> handle) {
+			handle_ = handle;
+			routines_coroutine_t *waiter = routines_spawn(entry, this);
+			if (waiter == nullptr) {
+				throw std::bad_alloc();
+			}
+			routines_detach(waiter);
+		}
+
+		T await_resume() {
+			return detail::decode<T>(message_);
+		}
+
+	private:
+		static void entry(void *arg) {
+			auto *self = static_cast<awaiter *>(arg);
+			self->message_ = routines_wait(self->queue_.get());
+			self->handle_.resume();
+		}
+
+		Queue &queue_;
+		std::coroutine_handle<> handle_;
+		void *message_ = nullptr;
+	};
+
+	awaiter operator co_await() noexcept {
+		return awaiter(*this);
+	}
+#endif
+
+private:
+	routines_queue_t *handle_ = nullptr;
+};
+
+/* Reply without blocking to a caller waiting on a queue of R */
+template <typename R, typename U = R>
+inline int reply(routines_queue_t *queue, U &&value) {
+	void *message = detail::encode<R>(std::forward<U>(value));
+	int error = routines_signal(queue, message);
+	if (error != 0) {
+		detail::discard<R>(message);
+	}
+	return error;
+}
+
+} /* namespace routines */
+
+#endif /* ROUTINES_HPP */
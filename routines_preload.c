@@ -0,0 +1,371 @@
+/*
+ * Interposition of blocking libc calls for co-routines
+ *
+ * Loaded with LD_PRELOAD ahead of libc, this turns blocking calls made
+ * from a co-routine into non-blocking calls that park the co-routine on
+ * the reactor of its thread. Calls from the initial task, from threads
+ * without co-routines and on descriptors the caller has made
+ * non-blocking are passed straight through.
+ *
+ * Author:  Curtis Millar
+ * Date:    11 October 2019
+ * Licence: MIT
+ */
+
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <routines.h>
+
+/* Look up the next definition of a libc function, once */
+#define REAL(name) ({ \
+	static __typeof__(name) *real_##name; \
+	if (real_##name == NULL) { \
+		real_##name = (__typeof__(name) *)dlsym(RTLD_NEXT, #name); \
+	} \
+	real_##name; \
+})
+
+/*
+ * Decide whether a call that would block should park the co-routine
+ *
+ * Descriptors made non-blocking by the caller keep reporting EAGAIN.
+ */
+static bool should_park(int fd);
+
+/* Check without blocking whether poll events are ready on a descriptor */
+static bool is_ready(int fd, short events);
+
+/*
+ * Park the current co-routine until an event is ready on a descriptor
+ *
+ * Returns false, leaving errno set, if the descriptor can't be waited
+ * on by the reactor.
+ */
+static bool park(int fd, uint32_t events);
+
+/* Receive from a socket, parking until data arrives */
+static ssize_t recv_parked(int fd, void *buf, size_t len, int flags);
+
+/* Send all of a buffer to a socket, parking while it is full */
+static ssize_t send_parked(int fd, const void *buf, size_t len, int flags);
+
+/* Convert poll events to epoll events */
+static uint32_t poll_to_epoll(short events);
+
+ssize_t read(int fd, void *buf, size_t count) {
+	if (routines_self() == NULL) {
+		return REAL(read)(fd, buf, count);
+	}
+
+	ssize_t bytes = recv_parked(fd, buf, count, 0);
+	if (bytes >= 0 || errno != ENOTSOCK) {
+		return bytes;
+	}
+
+	/* Pipes and terminals are read once they become readable */
+	if (should_park(fd) && !is_ready(fd, POLLIN)) {
+		park(fd, EPOLLIN);
+	}
+	return REAL(read)(fd, buf, count);
+}
+
+ssize_t write(int fd, const void *buf, size_t count) {
+	if (routines_self() == NULL) {
+		return REAL(write)(fd, buf, count);
+	}
+
+	ssize_t bytes = send_parked(fd, buf, count, 0);
+	if (bytes >= 0 || errno != ENOTSOCK) {
+		return bytes;
+	}
+
+	if (should_park(fd) && !is_ready(fd, POLLOUT)) {
+		park(fd, EPOLLOUT);
+	}
+	return REAL(write)(fd, buf, count);
+}
+
+ssize_t recv(int fd, void *buf, size_t len, int flags) {
+	if (routines_self() == NULL || (flags & MSG_DONTWAIT)) {
+		return REAL(recv)(fd, buf, len, flags);
+	}
+
+	return recv_parked(fd, buf, len, flags);
+}
+
+ssize_t send(int fd, const void *buf, size_t len, int flags) {
+	if (routines_self() == NULL || (flags & MSG_DONTWAIT)) {
+		return REAL(send)(fd, buf, len, flags);
+	}
+
+	return send_parked(fd, buf, len, flags);
+}
+
+int connect(int fd, const struct sockaddr *addr, socklen_t addrlen) {
+	if (routines_self() == NULL) {
+		return REAL(connect)(fd, addr, addrlen);
+	}
+
+	int flags = fcntl(fd, F_GETFL);
+	if (flags < 0 || (flags & O_NONBLOCK)) {
+		return REAL(connect)(fd, addr, addrlen);
+	}
+
+	/* Connect without blocking and wait for the outcome */
+	fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+	int result = REAL(connect)(fd, addr, addrlen);
+	if (result < 0 && errno == EINPROGRESS) {
+		int error = 0;
+		socklen_t size = sizeof(error);
+
+		if (
+			!park(fd, EPOLLOUT)
+			|| getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &size) < 0
+		) {
+			error = errno;
+		}
+
+		result = error == 0 ? 0 : -1;
+		errno = error;
+	}
+
+	int error = errno;
+	fcntl(fd, F_SETFL, flags);
+	errno = error;
+
+	return result;
+}
+
+int accept(int fd, struct sockaddr *addr, socklen_t *addrlen) {
+	if (routines_self() == NULL) {
+		return REAL(accept)(fd, addr, addrlen);
+	}
+
+	/* A listening socket is readable once a connection is waiting */
+	if (should_park(fd) && !is_ready(fd, POLLIN)) {
+		park(fd, EPOLLIN);
+	}
+	return REAL(accept)(fd, addr, addrlen);
+}
+
+int poll(struct pollfd *fds, nfds_t nfds, int timeout) {
+	if (routines_self() == NULL || timeout == 0) {
+		return REAL(poll)(fds, nfds, timeout);
+	}
+
+	int ready = REAL(poll)(fds, nfds, 0);
+	if (ready != 0) {
+		return ready;
+	}
+
+	/*
+	 * The descriptors and any timeout are gathered into an epoll
+	 * instance which is itself waited on by the reactor
+	 */
+	int poll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (poll_fd < 0) {
+		return REAL(poll)(fds, nfds, timeout);
+	}
+
+	/* Anything that can't be waited on leaves the call to block */
+	bool registered = true;
+	for (nfds_t f = 0; f < nfds && registered; f += 1) {
+		if (fds[f].fd < 0) {
+			continue;
+		}
+
+		struct epoll_event event = {
+			.events = poll_to_epoll(fds[f].events),
+			.data.u64 = f,
+		};
+		int result = epoll_ctl(poll_fd, EPOLL_CTL_ADD, fds[f].fd, &event);
+		if (result < 0 && errno == EEXIST) {
+			/* A repeated descriptor waits for the events of each entry */
+			for (nfds_t g = 0; g < f; g += 1) {
+				if (fds[g].fd == fds[f].fd) {
+					event.events |= poll_to_epoll(fds[g].events);
+				}
+			}
+			result = epoll_ctl(poll_fd, EPOLL_CTL_MOD, fds[f].fd, &event);
+		}
+		registered = result == 0;
+	}
+
+	int timer_fd = -1;
+	if (registered && timeout > 0) {
+		timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+		struct itimerspec expiry = {
+			.it_value = {
+				.tv_sec = timeout / 1000,
+				.tv_nsec = (timeout % 1000) * 1000000L,
+			},
+		};
+		struct epoll_event event = {
+			.events = EPOLLIN,
+			.data.u64 = UINT64_MAX,
+		};
+		registered = timer_fd >= 0
+			&& timerfd_settime(timer_fd, 0, &expiry, NULL) == 0
+			&& epoll_ctl(poll_fd, EPOLL_CTL_ADD, timer_fd, &event) == 0;
+	}
+
+	if (registered && park(poll_fd, EPOLLIN)) {
+		ready = REAL(poll)(fds, nfds, 0);
+	} else {
+		ready = REAL(poll)(fds, nfds, timeout);
+	}
+
+	int error = errno;
+	if (timer_fd >= 0) {
+		close(timer_fd);
+	}
+	close(poll_fd);
+	errno = error;
+
+	return ready;
+}
+
+int nanosleep(const struct timespec *duration, struct timespec *remaining) {
+	if (routines_self() == NULL) {
+		return REAL(nanosleep)(duration, remaining);
+	}
+
+	if (
+		duration->tv_sec < 0
+		|| duration->tv_nsec < 0
+		|| duration->tv_nsec >= 1000000000
+	) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	routines_sleep(
+		(uint64_t)duration->tv_sec * 1000000000 + duration->tv_nsec
+	);
+
+	if (remaining != NULL) {
+		*remaining = (struct timespec) {0, 0};
+	}
+	return 0;
+}
+
+int usleep(useconds_t usec) {
+	if (routines_self() == NULL) {
+		return REAL(usleep)(usec);
+	}
+
+	routines_sleep((uint64_t)usec * 1000);
+	return 0;
+}
+
+unsigned int sleep(unsigned int seconds) {
+	if (routines_self() == NULL) {
+		return REAL(sleep)(seconds);
+	}
+
+	routines_sleep((uint64_t)seconds * 1000000000);
+	return 0;
+}
+
+static bool should_park(int fd) {
+	int error = errno;
+	int flags = fcntl(fd, F_GETFL);
+	errno = error;
+
+	return flags >= 0 && !(flags & O_NONBLOCK);
+}
+
+static bool is_ready(int fd, short events) {
+	int error = errno;
+	struct pollfd poll_fd = {
+		.fd = fd,
+		.events = events,
+	};
+	int ready = REAL(poll)(&poll_fd, 1, 0);
+	errno = error;
+
+	return ready != 0;
+}
+
+static bool park(int fd, uint32_t events) {
+	int error = routines_wait_fd(fd, events, NULL);
+	if (error != 0) {
+		errno = error;
+		return false;
+	}
+	return true;
+}
+
+static ssize_t recv_parked(int fd, void *buf, size_t len, int flags) {
+	while (true) {
+		ssize_t bytes = REAL(recv)(fd, buf, len, flags | MSG_DONTWAIT);
+		if (bytes >= 0) {
+			return bytes;
+		}
+
+		if (
+			(errno != EAGAIN && errno != EWOULDBLOCK)
+			|| !should_park(fd)
+			|| !park(fd, EPOLLIN)
+		) {
+			return -1;
+		}
+	}
+}
+
+static ssize_t send_parked(int fd, const void *buf, size_t len, int flags) {
+	/* A blocking send returns once every byte has been queued */
+	size_t sent = 0;
+	do {
+		ssize_t bytes = REAL(send)(
+			fd,
+			(const char *)buf + sent,
+			len - sent,
+			flags | MSG_DONTWAIT
+		);
+		if (bytes >= 0) {
+			sent += bytes;
+			continue;
+		}
+
+		if (
+			(errno != EAGAIN && errno != EWOULDBLOCK)
+			|| !should_park(fd)
+			|| !park(fd, EPOLLOUT)
+		) {
+			return sent > 0 ? (ssize_t)sent : -1;
+		}
+	} while (sent < len);
+
+	return sent;
+}
+
+static uint32_t poll_to_epoll(short events) {
+	uint32_t converted = 0;
+	if (events & POLLIN) {
+		converted |= EPOLLIN;
+	}
+	if (events & POLLPRI) {
+		converted |= EPOLLPRI;
+	}
+	if (events & POLLOUT) {
+		converted |= EPOLLOUT;
+	}
+	if (events & POLLRDHUP) {
+		converted |= EPOLLRDHUP;
+	}
+	return converted;
+}
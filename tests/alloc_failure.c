@@ -0,0 +1,484 @@
+/*
+ * Allocation failure injection tests
+ *
+ * The library is linked statically with malloc, realloc, posix_memalign,
+ * free, mmap and munmap wrapped (see -Wl,--wrap in the Makefile), so that
+ * each of its allocations can be made to fail in turn. Every operation is
+ * run once for each allocation it makes, with that allocation failing,
+ * and must either succeed or report the failure without crashing or
+ * leaking what it had already allocated. Mapped files, such as those of
+ * checkpoints, are counted along with anonymous memory.
+ *
+ * Author:  Curtis Millar
+ * Date:    11 October 2019
+ * Licence: MIT
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <routines.h>
+
+/* A call made from a co-routine with an allocation set to fail */
+typedef struct {
+	routines_queue_t *queue;
+	routines_queue_t *reply;
+	long allocation;
+	int error;
+	void *result;
+} call_t;
+
+/* State saved for a checkpointed co-routine */
+typedef struct {
+	uint64_t progress;
+} progress_t;
+
+/* Allocations to allow before one fails, or -1 to never fail */
+static long countdown = -1;
+
+/* An allocation has been made to fail since the countdown was set */
+static bool injected;
+
+/* Blocks allocated by the library and not yet freed */
+static long blocks;
+
+/* Bytes mapped by the library and not yet unmapped */
+static long mapped;
+
+/* File that checkpoints are saved to */
+static char checkpoint_path[64];
+
+void *__real_malloc(size_t size);
+void *__real_realloc(void *ptr, size_t size);
+int __real_posix_memalign(void **ptr, size_t alignment, size_t size);
+void __real_free(void *ptr);
+void *__real_mmap(
+	void *addr,
+	size_t length,
+	int prot,
+	int flags,
+	int fd,
+	off_t offset
+);
+int __real_munmap(void *addr, size_t length);
+
+/* Check whether the next allocation should fail */
+static bool inject(void);
+
+/* Run an operation with each of its allocations failing in turn */
+static void run(const char *name, bool (*operation)(void));
+
+/* Operations under test, each returning whether it succeeded */
+static bool spawn(void);
+static bool spawn_ex(void);
+static bool queue_create(void);
+static bool queue_create_ex(void);
+static bool signal_message(void);
+static bool pool_create(void);
+static bool pool_submit(void);
+static bool call_message(void);
+static bool buffers(void);
+static bool ratelimit(void);
+static bool checkpoint_save(void);
+static bool checkpoint_restore(void);
+static bool log_record(void);
+
+/* Tasks run by the operations under test */
+static void nothing(void *arg);
+static void caller(void *arg);
+static void parked(void *arg);
+static void *logger(void *arg);
+
+int main(void) {
+	run("routines_spawn", spawn);
+	run("routines_spawn_ex", spawn_ex);
+	run("routines_queue_create", queue_create);
+	run("routines_queue_create_ex", queue_create_ex);
+	run("routines_signal", signal_message);
+	run("routines_pool_create", pool_create);
+	run("routines_pool_submit", pool_submit);
+	run("routines_call_ex", call_message);
+	run("routines_buffers", buffers);
+	run("routines_ratelimit", ratelimit);
+
+	snprintf(
+		checkpoint_path,
+		sizeof(checkpoint_path),
+		"/tmp/alloc_failure.%ld.checkpoint",
+		(long)getpid()
+	);
+	run("routines_checkpoint_save", checkpoint_save);
+	run("routines_checkpoint_restore", checkpoint_restore);
+	unlink(checkpoint_path);
+
+	/* Each record is logged from a new thread so that its log is created */
+	int null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+	assert(null_fd >= 0);
+	routines_log_config(null_fd, 0, 0);
+	run("routines_log", log_record);
+
+	return EXIT_SUCCESS;
+}
+
+void *__wrap_malloc(size_t size) {
+	if (inject()) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	void *block = __real_malloc(size);
+	blocks += block != NULL;
+	return block;
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+	if (inject()) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	void *block = __real_realloc(ptr, size);
+	blocks += block != NULL && ptr == NULL;
+	return block;
+}
+
+int __wrap_posix_memalign(void **ptr, size_t alignment, size_t size) {
+	if (inject()) {
+		return ENOMEM;
+	}
+
+	int error = __real_posix_memalign(ptr, alignment, size);
+	blocks += error == 0;
+	return error;
+}
+
+void __wrap_free(void *ptr) {
+	blocks -= ptr != NULL;
+	__real_free(ptr);
+}
+
+void *__wrap_mmap(
+	void *addr,
+	size_t length,
+	int prot,
+	int flags,
+	int fd,
+	off_t offset
+) {
+	if (inject()) {
+		errno = ENOMEM;
+		return MAP_FAILED;
+	}
+
+	void *mapping = __real_mmap(addr, length, prot, flags, fd, offset);
+	if (mapping != MAP_FAILED) {
+		mapped += length;
+	}
+	return mapping;
+}
+
+int __wrap_munmap(void *addr, size_t length) {
+	mapped -= length;
+	return __real_munmap(addr, length);
+}
+
+static bool inject(void) {
+	if (countdown < 0) {
+		return false;
+	}
+	if (countdown > 0) {
+		countdown -= 1;
+		return false;
+	}
+
+	countdown = -1;
+	injected = true;
+	return true;
+}
+
+static void run(const char *name, bool (*operation)(void)) {
+	/* State kept for the life of the thread is created up front */
+	if (!operation()) {
+		fprintf(stderr, "%s: failed without an injected failure\n", name);
+		exit(EXIT_FAILURE);
+	}
+	routines_trim(0);
+	long blocks_before = blocks;
+
+	long failures = 0;
+	long allocation;
+	for (allocation = 0; ; allocation += 1) {
+		countdown = allocation;
+		injected = false;
+		bool succeeded = operation();
+		countdown = -1;
+
+		/* Unused stacks are kept for reuse so are released to be counted */
+		routines_trim(0);
+		if (blocks != blocks_before || mapped != 0) {
+			fprintf(
+				stderr,
+				"%s: leaked %ld blocks and %ld bytes mapped"
+				" with allocation %ld failing\n",
+				name,
+				blocks - blocks_before,
+				mapped,
+				allocation
+			);
+			exit(EXIT_FAILURE);
+		}
+
+		if (!injected) {
+			assert(succeeded);
+			break;
+		}
+		failures += !succeeded;
+	}
+
+	printf(
+		"%-28s %ld allocations failed, %ld failures reported\n",
+		name,
+		allocation,
+		failures
+	);
+}
+
+static bool spawn(void) {
+	routines_coroutine_t *coroutine = routines_spawn(nothing, NULL);
+	if (coroutine == NULL) {
+		return false;
+	}
+
+	routines_destroy(coroutine);
+	return true;
+}
+
+static bool spawn_ex(void) {
+	routines_coroutine_t *coroutine = NULL;
+	int error = routines_spawn_ex(&coroutine, nothing, NULL);
+	if (error != 0) {
+		assert(error == ENOMEM);
+		return false;
+	}
+
+	routines_destroy(coroutine);
+	return true;
+}
+
+static bool queue_create(void) {
+	routines_queue_t *queue = routines_queue_create();
+	if (queue == NULL) {
+		return false;
+	}
+
+	routines_queue_destroy(queue);
+	return true;
+}
+
+static bool queue_create_ex(void) {
+	routines_queue_t *queue = NULL;
+	int error = routines_queue_create_ex(&queue);
+	if (error != 0) {
+		assert(error == ENOMEM);
+		assert(queue == NULL);
+		return false;
+	}
+
+	routines_queue_destroy(queue);
+	return true;
+}
+
+static bool signal_message(void) {
+	/* Only the message itself is allowed to fail */
+	long allocation = countdown;
+	countdown = -1;
+	routines_queue_t *queue = routines_queue_create();
+	assert(queue != NULL);
+
+	countdown = allocation;
+	int error = routines_signal(queue, (void *)(uintptr_t)1);
+	countdown = -1;
+	if (error != 0) {
+		assert(error == ENOMEM);
+		assert(routines_read(queue) == NULL);
+	}
+
+	routines_queue_destroy(queue);
+	return error == 0;
+}
+
+static bool pool_create(void) {
+	routines_pool_t *pool = routines_pool_create(nothing, 2, 4);
+	if (pool == NULL) {
+		return false;
+	}
+
+	routines_pool_destroy(pool);
+	return true;
+}
+
+static bool pool_submit(void) {
+	long allocation = countdown;
+	countdown = -1;
+	routines_pool_t *pool = routines_pool_create(nothing, 0, 1);
+	assert(pool != NULL);
+
+	countdown = allocation;
+	int error = routines_pool_submit(pool, (void *)(uintptr_t)1);
+	countdown = -1;
+	if (error != 0) {
+		assert(error == ENOMEM);
+	}
+
+	routines_pool_destroy(pool);
+	return error == 0;
+}
+
+static bool call_message(void) {
+	call_t call = {
+		.allocation = countdown,
+		.error = -1,
+	};
+	countdown = -1;
+	call.queue = routines_queue_create();
+	call.reply = routines_queue_create();
+	assert(call.queue != NULL && call.reply != NULL);
+
+	/* Only the call itself is allowed to fail */
+	routines_coroutine_t *client = routines_spawn(caller, &call);
+	countdown = -1;
+	assert(client != NULL);
+
+	/* A call that was queued waits for the reply */
+	if (call.error == -1) {
+		void *message = routines_read(call.queue);
+		assert(message == (void *)(uintptr_t)1);
+		assert(routines_signal(call.reply, message) == 0);
+		routines_yield();
+		assert(call.error == 0);
+		assert(call.result == message);
+	} else {
+		assert(call.error == ENOMEM);
+		assert(routines_read(call.queue) == NULL);
+	}
+
+	routines_destroy(client);
+	routines_queue_destroy(call.queue);
+	routines_queue_destroy(call.reply);
+	return call.error == 0;
+}
+
+static bool buffers(void) {
+	routines_buffers_t *pool = routines_buffers_create(4096, 2);
+	if (pool == NULL) {
+		return false;
+	}
+
+	void *buffer = routines_buffer_take(pool);
+	if (buffer != NULL) {
+		routines_buffer_release(pool, buffer);
+	} else {
+		assert(errno == ENOMEM);
+	}
+
+	routines_buffers_destroy(pool);
+	return buffer != NULL;
+}
+
+static bool ratelimit(void) {
+	routines_ratelimit_t *limit = routines_ratelimit_create(1000, 10);
+	if (limit == NULL) {
+		return false;
+	}
+
+	assert(routines_ratelimit_try_acquire(limit, 10));
+	routines_ratelimit_destroy(limit);
+	return true;
+}
+
+static bool checkpoint_save(void) {
+	progress_t progress = {
+		.progress = 1,
+	};
+	routines_coroutine_t *coroutine = routines_spawn(parked, &progress);
+	if (coroutine == NULL) {
+		return false;
+	}
+
+	int error = ENOMEM;
+	routines_checkpoint_t *checkpoint = routines_checkpoint_create();
+	if (checkpoint != NULL) {
+		error = routines_checkpoint_add(
+			checkpoint,
+			coroutine,
+			sizeof(progress)
+		);
+		if (error == 0) {
+			error = routines_checkpoint_save(checkpoint, checkpoint_path);
+		}
+		routines_checkpoint_destroy(checkpoint);
+	}
+	assert(error == 0 || error == ENOMEM);
+
+	routines_destroy(coroutine);
+	return error == 0;
+}
+
+static bool checkpoint_restore(void) {
+	routines_checkpoint_t *checkpoint = routines_checkpoint_restore(
+		checkpoint_path
+	);
+	if (checkpoint == NULL) {
+		assert(errno == ENOMEM);
+		return false;
+	}
+
+	assert(routines_checkpoint_count(checkpoint) == 1);
+	routines_destroy(routines_checkpoint_coroutine(checkpoint, 0));
+	routines_checkpoint_destroy(checkpoint);
+	return true;
+}
+
+static bool log_record(void) {
+	/* Logging reports no failure, so success is only a lack of leaks */
+	pthread_t thread;
+	int error = pthread_create(&thread, NULL, logger, NULL);
+	assert(error == 0);
+	pthread_join(thread, NULL);
+	return true;
+}
+
+static void nothing(void *arg) {
+	(void)arg;
+}
+
+static void caller(void *arg) {
+	call_t *call = arg;
+
+	countdown = call->allocation;
+	call->error = routines_call_ex(
+		call->queue,
+		(void *)(uintptr_t)1,
+		call->reply,
+		&call->result
+	);
+}
+
+static void parked(void *arg) {
+	(void)arg;
+	routines_suspend(routines_self());
+}
+
+static void *logger(void *arg) {
+	(void)arg;
+	routines_log("record %d\n", 1);
+	routines_log_flush();
+	return NULL;
+}